@@ -0,0 +1,160 @@
+/*
+This file is part of libusbserial.
+
+libusbserial is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2 of the License.
+
+libusbserial is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libusbserial. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* This file contains a benchmark of the FTDI modem status stripping,
+ * built with -DLIBUSBSERIAL_BUILD_BENCH=ON.
+ *
+ * Usage: ftdi_strip_bench [transfer_bytes [packet_bytes [iterations]]]
+ *
+ * ftdi_strip_modem_status() of the driver, as used by its read
+ * postprocessor, is measured against the byte loop it replaced. Both
+ * include restoring the transfer from a template, which is reported
+ * separately. */
+
+#include "driver_ftdi.h"
+
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The postprocessor before it stripped whole packets. */
+static void bench_byte_loop_strip(
+        unsigned int max_packet_size,
+        void* data,
+        unsigned int* bytes_count)
+{
+    unsigned int i;
+    unsigned int skip_bytes_count = FTDI_MODEM_STATUS_BYTES_COUNT;
+    const unsigned int unfiltered_bytes_count = *bytes_count;
+    char* data_as_chars = (char*) data;
+
+    for (i = FTDI_MODEM_STATUS_BYTES_COUNT; i < unfiltered_bytes_count; ++i)
+    {
+        if (0 == (i % max_packet_size))
+        {
+            skip_bytes_count += FTDI_MODEM_STATUS_BYTES_COUNT;
+            ++i;
+        }
+        else
+        {
+            data_as_chars[i - skip_bytes_count] = data_as_chars[i];
+        }
+    }
+
+    *bytes_count -= skip_bytes_count;
+}
+
+static void bench_report(
+        const char* name,
+        uint64_t elapsed_micros,
+        unsigned int transfer_bytes,
+        unsigned int iterations)
+{
+    double seconds = (double) elapsed_micros / 1e6;
+    double bytes = (double) transfer_bytes * (double) iterations;
+
+    printf("%-16s %10.3f ms %10.1f MB/s\n",
+           name,
+           seconds * 1e3,
+           (seconds > 0) ? (bytes / seconds / 1e6) : 0.0);
+}
+
+int main(int argc, char** argv)
+{
+    unsigned int transfer_bytes = (argc > 1) ? (unsigned int) strtoul(argv[1], NULL, 0) : 16384;
+    unsigned int packet_bytes = (argc > 2) ? (unsigned int) strtoul(argv[2], NULL, 0) : 512;
+    unsigned int iterations = (argc > 3) ? (unsigned int) strtoul(argv[3], NULL, 0) : 100000;
+    unsigned char* template_data;
+    unsigned char* data;
+    unsigned char* expected;
+    unsigned int expected_count = 0;
+    unsigned int i, count = 0;
+    uint64_t start, copy_micros, byte_loop_micros, strip_micros;
+
+    if ((0 == transfer_bytes) || (packet_bytes <= FTDI_MODEM_STATUS_BYTES_COUNT) || (0 == iterations))
+    {
+        fprintf(stderr, "usage: %s [transfer_bytes [packet_bytes [iterations]]]\n", argv[0]);
+        return 1;
+    }
+
+    template_data = (unsigned char*) malloc(transfer_bytes);
+    data = (unsigned char*) malloc(transfer_bytes);
+    expected = (unsigned char*) malloc(transfer_bytes);
+    if ((!template_data) || (!data) || (!expected)) return 1;
+
+    for (i = 0; i < transfer_bytes; ++i)
+    {
+        if ((i % packet_bytes) < FTDI_MODEM_STATUS_BYTES_COUNT)
+        {
+            template_data[i] = (unsigned char) (((i % packet_bytes) == 0) ? 0x01 : 0x60);
+        }
+        else
+        {
+            template_data[i] = (unsigned char) (i * 31);
+            expected[expected_count++] = template_data[i];
+        }
+    }
+
+    /* Both must produce the same payload. */
+    memcpy(data, template_data, transfer_bytes);
+    count = transfer_bytes;
+    ftdi_strip_modem_status(data, &count, packet_bytes);
+    if ((count != expected_count) || (0 != memcmp(data, expected, count))) return 2;
+    memcpy(data, template_data, transfer_bytes);
+    count = transfer_bytes;
+    bench_byte_loop_strip(packet_bytes, data, &count);
+    if ((count != expected_count) || (0 != memcmp(data, expected, count))) return 2;
+
+    start = usbserial_common_get_time_micros();
+    for (i = 0; i < iterations; ++i)
+    {
+        memcpy(data, template_data, transfer_bytes);
+        count += data[i % transfer_bytes];
+    }
+    copy_micros = usbserial_common_get_time_micros() - start;
+
+    start = usbserial_common_get_time_micros();
+    for (i = 0; i < iterations; ++i)
+    {
+        memcpy(data, template_data, transfer_bytes);
+        count = transfer_bytes;
+        bench_byte_loop_strip(packet_bytes, data, &count);
+    }
+    byte_loop_micros = usbserial_common_get_time_micros() - start;
+
+    start = usbserial_common_get_time_micros();
+    for (i = 0; i < iterations; ++i)
+    {
+        memcpy(data, template_data, transfer_bytes);
+        count = transfer_bytes;
+        ftdi_strip_modem_status(data, &count, packet_bytes);
+    }
+    strip_micros = usbserial_common_get_time_micros() - start;
+
+    printf("%u byte transfers, %u byte packets, %u iterations\n",
+           transfer_bytes, packet_bytes, iterations);
+    bench_report("copy only", copy_micros, transfer_bytes, iterations);
+    bench_report("byte loop", byte_loop_micros, transfer_bytes, iterations);
+    bench_report("per packet", strip_micros, transfer_bytes, iterations);
+
+    free(expected);
+    free(data);
+    free(template_data);
+
+    return 0;
+}
@@ -20,9 +20,21 @@ along with libusbserial. If not, see <http://www.gnu.org/licenses/>.
 
 #include "config.h"
 #include "driver.h"
+#include "event_thread.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 union uint32_bytes
 {
@@ -30,180 +42,1768 @@ union uint32_bytes
     unsigned char byte_values[4];
 };
 
-static void usbserial_common_default_read_transfer_callback(struct libusb_transfer* transfer)
+void usbserial_common_mutex_lock(usbserial_mutex_t* mutex)
 {
-    assert(transfer);
+    assert(mutex);
 
-    struct usbserial_port* port = (struct usbserial_port*) transfer->user_data;
-#ifndef _WIN32
-    int pthread_ret;
-#   ifdef NDEBUG
-        USBSERIAL_UNUSED_VAR(pthread_ret);
-#   endif
+#ifdef _WIN32
+    EnterCriticalSection(mutex);
+#else
+    int pthread_ret = pthread_mutex_lock(mutex);
+    assert(0 == pthread_ret);
+    USBSERIAL_UNUSED_VAR(pthread_ret);
 #endif
-    assert(port);
+}
+
+void usbserial_common_mutex_unlock(usbserial_mutex_t* mutex)
+{
+    assert(mutex);
 
 #ifdef _WIN32
-    EnterCriticalSection(&port->mutex);
+    LeaveCriticalSection(mutex);
 #else
-    pthread_ret = pthread_mutex_lock(&port->mutex);
+    int pthread_ret = pthread_mutex_unlock(mutex);
     assert(0 == pthread_ret);
+    USBSERIAL_UNUSED_VAR(pthread_ret);
 #endif
+}
 
-    if ((LIBUSB_TRANSFER_COMPLETED == transfer->status)
-            || (LIBUSB_TRANSFER_TIMED_OUT == transfer->status))
+void usbserial_common_cond_wait(usbserial_cond_t* cond, usbserial_mutex_t* mutex)
+{
+    assert(cond);
+    assert(mutex);
+
+#ifdef _WIN32
+    BOOL sleep_ret = SleepConditionVariableCS(cond, mutex, INFINITE);
+    assert(sleep_ret);
+    USBSERIAL_UNUSED_VAR(sleep_ret);
+#else
+    int pthread_ret = pthread_cond_wait(cond, mutex);
+    assert(0 == pthread_ret);
+    USBSERIAL_UNUSED_VAR(pthread_ret);
+#endif
+}
+
+void usbserial_common_cond_broadcast(usbserial_cond_t* cond)
+{
+    assert(cond);
+
+#ifdef _WIN32
+    WakeAllConditionVariable(cond);
+#else
+    int pthread_ret = pthread_cond_broadcast(cond);
+    assert(0 == pthread_ret);
+    USBSERIAL_UNUSED_VAR(pthread_ret);
+#endif
+}
+
+void usbserial_common_cond_signal(usbserial_cond_t* cond)
+{
+    assert(cond);
+
+#ifdef _WIN32
+    WakeConditionVariable(cond);
+#else
+    int pthread_ret = pthread_cond_signal(cond);
+    assert(0 == pthread_ret);
+    USBSERIAL_UNUSED_VAR(pthread_ret);
+#endif
+}
+
+int usbserial_common_cond_timedwait(
+        usbserial_cond_t* cond,
+        usbserial_mutex_t* mutex,
+        unsigned int timeout_millis)
+{
+    assert(cond);
+    assert(mutex);
+
+#ifdef _WIN32
+    if (SleepConditionVariableCS(cond, mutex, timeout_millis)) return 0;
+    assert(ERROR_TIMEOUT == GetLastError());
+    return 1;
+#else
+    struct timespec deadline;
+    int pthread_ret;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_millis / 1000;
+    deadline.tv_nsec += (long) (timeout_millis % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
     {
-        unsigned int count = (unsigned int) transfer->actual_length;
-        if (count > 0)
+        ++deadline.tv_sec;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_ret = pthread_cond_timedwait(cond, mutex, &deadline);
+    assert((0 == pthread_ret) || (ETIMEDOUT == pthread_ret));
+    return (ETIMEDOUT == pthread_ret) ? 1 : 0;
+#endif
+}
+
+uint64_t usbserial_common_get_time_micros(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return ((uint64_t) (counter.QuadPart / frequency.QuadPart)) * 1000000
+            + ((uint64_t) (counter.QuadPart % frequency.QuadPart)) * 1000000
+                / frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t) now.tv_sec) * 1000000 + (uint64_t) (now.tv_nsec / 1000);
+#endif
+}
+
+uint64_t usbserial_common_get_deadline_micros(unsigned int timeout_millis)
+{
+    if (0 == timeout_millis) return 0;
+
+    return usbserial_common_get_time_micros() + ((uint64_t) timeout_millis) * 1000;
+}
+
+int usbserial_common_get_remaining_millis(
+        uint64_t deadline_micros,
+        unsigned int* out_timeout_millis)
+{
+    uint64_t now;
+
+    *out_timeout_millis = 0;
+    if (0 == deadline_micros) return 0;
+
+    now = usbserial_common_get_time_micros();
+    if (now >= deadline_micros) return LIBUSB_ERROR_TIMEOUT;
+
+    *out_timeout_millis = (unsigned int) ((deadline_micros - now + 999) / 1000);
+    return 0;
+}
+
+void* usbserial_common_aligned_alloc(size_t size, size_t alignment)
+{
+    assert((alignment > 0) && (0 == (alignment & (alignment - 1))));
+
+#ifdef _WIN32
+    return _aligned_malloc(size, alignment);
+#else
+    void* ptr;
+
+    if (alignment < sizeof(void*)) alignment = sizeof(void*);
+    if (0 != posix_memalign(&ptr, alignment, size)) return NULL;
+    return ptr;
+#endif
+}
+
+void usbserial_common_aligned_free(void* ptr)
+{
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+int usbserial_common_get_transfer_error(enum libusb_transfer_status status)
+{
+    switch (status)
+    {
+    case LIBUSB_TRANSFER_COMPLETED:
+        return 0;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        return LIBUSB_ERROR_TIMEOUT;
+    case LIBUSB_TRANSFER_CANCELLED:
+        return LIBUSB_ERROR_INTERRUPTED;
+    case LIBUSB_TRANSFER_STALL:
+        return LIBUSB_ERROR_PIPE;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        return LIBUSB_ERROR_NO_DEVICE;
+    case LIBUSB_TRANSFER_OVERFLOW:
+        return LIBUSB_ERROR_OVERFLOW;
+
+    default:
+        return LIBUSB_ERROR_IO;
+    }
+}
+
+/* Cancel all submitted read transfers of a port. Their callbacks
+ * are invoked later, with port->mutex locked. */
+static int usbserial_common_cancel_read_transfers(struct usbserial_port* port)
+{
+    unsigned int i;
+    int ret = 0;
+
+    for (i = 0; i < port->read_transfers_count; ++i)
+    {
+        if (port->read_transfers[i].submitted)
         {
-            if (port->driver->read_data_postprocessor)
+            int cancel_ret = libusb_cancel_transfer(port->read_transfers[i].transfer);
+            /* LIBUSB_ERROR_NOT_FOUND: the transfer has already
+             * completed, its callback is pending. */
+            if ((0 != cancel_ret) && (LIBUSB_ERROR_NOT_FOUND != cancel_ret) && (0 == ret))
             {
-                port->driver->read_data_postprocessor(port, transfer->buffer, &count);
+                ret = cancel_ret;
             }
         }
+    }
 
-        if (count > 0)
-        {
-            port->read_cb(
-                        transfer->buffer,
-                        count,
-                        port->cb_user_data);
-        }
+    return ret;
+}
 
-        libusb_submit_transfer(transfer);
-    }
-    else if (LIBUSB_TRANSFER_CANCELLED == transfer->status)
+/* Wake a thread blocked in usbserial_read(). A nonzero status
+ * is returned by usbserial_read() once the ring is empty. */
+static void usbserial_common_signal_read_event(struct usbserial_port* port)
+{
+#ifndef _WIN32
+    int fd = atomic_load(&port->read_event_fd);
+    ssize_t write_ret;
+
+    if (fd < 0) return;
+    if (atomic_exchange(&port->read_event_signaled, 1)) return;
+
+#ifdef __linux__
     {
-#ifdef _WIN32
-        BOOL set_event_ret = SetEvent(port->cancel_event);
-        assert(set_event_ret);
+        uint64_t value = 1;
+        write_ret = write(port->read_event_write_fd, &value, sizeof(value));
+    }
 #else
-        pthread_ret = pthread_cond_signal(&port->cancel_cond);
-        assert(0 == pthread_ret);
+    write_ret = write(port->read_event_write_fd, "", 1);
 #endif
-    }
-    else
-    {
-        port->read_error_flag = 1;
+    /* Fails only if the fd is readable already. */
+    USBSERIAL_UNUSED_VAR(write_ret);
+#else
+    USBSERIAL_UNUSED_VAR(port);
+#endif
+}
+
+int usbserial_common_open_read_event(struct usbserial_port* port)
+{
+    assert(port);
+
 #ifdef _WIN32
-        BOOL set_event_ret = SetEvent(port->cancel_event);
-        assert(set_event_ret);
+    return USBSERIAL_ERROR_UNSUPPORTED_OPERATION;
+#else
+    int fd = atomic_load(&port->read_event_fd);
+
+    if (fd >= 0) return fd;
+
+#ifdef __linux__
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) return USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
+    port->read_event_write_fd = fd;
+#else
+    {
+        int fds[2];
+        if (0 != pipe(fds)) return USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
+        fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+        fd = fds[0];
+        port->read_event_write_fd = fds[1];
+    }
 #endif
-        if (port->read_error_cb) port->read_error_cb(transfer->status, port->cb_user_data);
+
+    atomic_store(&port->read_event_signaled, 0);
+    atomic_store(&port->read_event_fd, fd);
+
+    if ((port->read_ring.data && (usbserial_ring_buffer_used(&port->read_ring) > 0))
+            || (0 != atomic_load(&port->read_ring_status)))
+    {
+        usbserial_common_signal_read_event(port);
     }
 
-#ifdef _WIN32
-    LeaveCriticalSection(&port->mutex);
+    return fd;
+#endif
+}
+
+void usbserial_common_close_read_event(struct usbserial_port* port)
+{
+    assert(port);
+
+#ifndef _WIN32
+    int fd = atomic_load(&port->read_event_fd);
+
+    if (fd < 0) return;
+
+    if (port->read_event_write_fd != fd) close(port->read_event_write_fd);
+    close(fd);
+    atomic_store(&port->read_event_fd, -1);
+    port->read_event_write_fd = -1;
+#endif
+}
+
+static void usbserial_common_clear_read_event(struct usbserial_port* port)
+{
+#ifndef _WIN32
+    int fd = atomic_load(&port->read_event_fd);
+    unsigned char drain[8];
+
+    if (fd < 0) return;
+    if (!atomic_exchange(&port->read_event_signaled, 0)) return;
+
+    while (read(fd, drain, sizeof(drain)) > 0) {}
 #else
-    pthread_ret = pthread_mutex_unlock(&port->mutex);
-    assert(0 == pthread_ret);
+    USBSERIAL_UNUSED_VAR(port);
 #endif
 }
 
-void usbserial_common_init_bulk_read_transfer(
-        struct libusb_transfer* transfer,
-        unsigned char endpoint,
-        struct usbserial_port* port)
+void usbserial_common_update_read_event(struct usbserial_port* port)
 {
-    assert(transfer);
     assert(port);
 
-    libusb_fill_bulk_transfer(
-                transfer,
-                port->usb_device_handle,
-                endpoint,
-                port->read_buffer,
-                sizeof(port->read_buffer),
-                usbserial_common_default_read_transfer_callback,
-                port,
-                DEFAULT_READ_TIMEOUT_MILLIS);
+    if (atomic_load(&port->read_event_fd) < 0) return;
+    if (0 != atomic_load(&port->read_ring_status)) return;
+    if (port->read_ring.data && (usbserial_ring_buffer_used(&port->read_ring) > 0)) return;
+
+    usbserial_common_clear_read_event(port);
+
+    /* Data may have been written since the check above, its signal
+     * may have been drained. */
+    if ((port->read_ring.data && (usbserial_ring_buffer_used(&port->read_ring) > 0))
+            || (0 != atomic_load(&port->read_ring_status)))
+    {
+        usbserial_common_signal_read_event(port);
+    }
+}
+
+static void usbserial_common_wake_read_ring(struct usbserial_port* port, int status)
+{
+    if (0 != status) atomic_store(&port->read_ring_status, status);
+
+    /* Without a ring buffer, only read errors are signalled. */
+    if (port->read_ring.data || (LIBUSB_ERROR_IO == status))
+    {
+        usbserial_common_signal_read_event(port);
+    }
+
+    if (atomic_load(&port->read_ring_waiting))
+    {
+        usbserial_common_mutex_lock(&port->read_ring_mutex);
+        usbserial_common_cond_broadcast(&port->read_ring_cond);
+        usbserial_common_mutex_unlock(&port->read_ring_mutex);
+    }
 }
 
-int usbserial_common_cancel_read_transfer_sync(
+static void usbserial_common_fail_reader(
         struct usbserial_port* port,
-        struct libusb_transfer* transfer)
+        enum libusb_transfer_status status)
+{
+    port->read_error_flag = 1;
+    usbserial_common_cancel_read_transfers(port);
+    usbserial_common_wake_read_ring(port, LIBUSB_ERROR_IO);
+    if (port->read_error_cb) port->read_error_cb(status, port->cb_user_data);
+}
+
+unsigned int usbserial_common_get_bits_per_char(const struct usbserial_line_config* line_config)
+{
+    assert(line_config);
+
+    return 1 + (unsigned int) line_config->data_bits
+            + ((USBSERIAL_PARITY_NONE != line_config->parity) ? 1 : 0)
+            + ((USBSERIAL_STOPBITS_1 != line_config->stop_bits) ? 2 : 1);
+}
+
+static unsigned int usbserial_common_get_adaptive_read_timeout(struct usbserial_port* port)
+{
+    const struct usbserial_line_config* line_config = &port->line_config;
+    unsigned int bits_per_char, bytes_count, transfer_size, timeout_millis;
+
+    if (0 == line_config->baud) return DEFAULT_READ_TIMEOUT_MILLIS;
+
+    bits_per_char = usbserial_common_get_bits_per_char(line_config);
+
+    /* A device which pauses at a packet boundary sends no short
+     * packet, the transfer then only completes on its timeout.
+     * Deliver if no more data follows within about two packet times. */
+    transfer_size = port->read_transfer_size ? port->read_transfer_size : port->read_buffer_size;
+    bytes_count = 2 * (port->read_max_packet_size ? port->read_max_packet_size : 64);
+    if (bytes_count > transfer_size) bytes_count = transfer_size;
+
+    timeout_millis = (unsigned int) (((uint64_t) bytes_count * bits_per_char * 1000
+                                      + line_config->baud - 1) / line_config->baud);
+
+    if (timeout_millis < MIN_ADAPTIVE_READ_TIMEOUT_MILLIS)
+    {
+        timeout_millis = MIN_ADAPTIVE_READ_TIMEOUT_MILLIS;
+    }
+    else if (timeout_millis > DEFAULT_READ_TIMEOUT_MILLIS)
+    {
+        timeout_millis = DEFAULT_READ_TIMEOUT_MILLIS;
+    }
+
+    return timeout_millis;
+}
+
+void usbserial_common_update_read_timeout(struct usbserial_port* port)
 {
+    unsigned int timeout_millis;
+
     assert(port);
-    assert(transfer);
 
-#ifndef _WIN32
-    int pthread_ret;
-#   ifdef NDEBUG
-        USBSERIAL_UNUSED_VAR(pthread_ret);
-#   endif
-#endif
-    int cancel_ret = 0;
-    int read_error_flag_set = 0;
+    if (port->read_timeout_override >= 0)
+    {
+        timeout_millis = (unsigned int) port->read_timeout_override;
+    }
+    else
+    {
+        timeout_millis = usbserial_common_get_adaptive_read_timeout(port);
+    }
 
-    do
+    if (port->read_coalesce_buffer)
     {
-#ifdef _WIN32
-        EnterCriticalSection(&port->mutex);
-#else
-        pthread_ret = pthread_mutex_lock(&port->mutex);
-        assert(0 == pthread_ret);
-#endif
+        /* Bound the delay of collected data also on an idle line. */
+        unsigned int max_delay_millis = (port->read_coalesce_max_delay_micros + 999) / 1000;
+        if (0 == max_delay_millis) max_delay_millis = 1;
+        if ((0 == timeout_millis) || (max_delay_millis < timeout_millis))
+        {
+            timeout_millis = max_delay_millis;
+        }
+    }
+
+    port->read_timeout_millis = timeout_millis;
+}
 
-        if (port->read_error_flag)
+/* The timeout for the next submitted transfer. The adaptive timeout
+ * backs off while the line is idle, to avoid needless wakeups. */
+static unsigned int usbserial_common_get_read_timeout(struct usbserial_port* port)
+{
+    unsigned int timeout_millis = port->read_timeout_millis;
+    unsigned int i;
+
+    if ((port->read_timeout_override < 0) && (!port->read_coalesce_buffer))
+    {
+        for (i = 0; (i < port->read_idle_timeouts) && (timeout_millis < MAX_IDLE_READ_TIMEOUT_MILLIS); ++i)
         {
-            read_error_flag_set = 1;
+            timeout_millis *= 2;
         }
-        else
+        if (timeout_millis > MAX_IDLE_READ_TIMEOUT_MILLIS) timeout_millis = MAX_IDLE_READ_TIMEOUT_MILLIS;
+    }
+
+    return timeout_millis;
+}
+
+static struct usbserial_buffer* usbserial_common_take_read_buffer(struct usbserial_port* port)
+{
+    struct usbserial_buffer* buffer = port->read_free_buffers;
+    if (buffer) port->read_free_buffers = buffer->next_free;
+    return buffer;
+}
+
+static void usbserial_common_put_read_buffer(
+        struct usbserial_port* port,
+        struct usbserial_buffer* buffer)
+{
+    buffer->next_free = port->read_free_buffers;
+    port->read_free_buffers = buffer;
+}
+
+/* Whether USBSERIAL_BACKPRESSURE_BLOCK keeps another transfer from
+ * being submitted. In buffered reading, the data of all transfers
+ * which are submitted, queued or being processed must fit into the
+ * ring. Must be called with port->mutex locked. */
+static int usbserial_common_read_backlog_full(struct usbserial_port* port)
+{
+    if (USBSERIAL_BACKPRESSURE_BLOCK != port->read_backpressure) return 0;
+
+    if (port->read_ring.data)
+    {
+        size_t in_flight = port->read_transfers_count
+                - port->read_parked_count
+                + port->read_callbacks_running
+                + 1;
+        size_t reserved = port->read_queue_bytes + (in_flight * port->read_transfer_size);
+
+        return reserved > (port->read_ring.capacity
+                           - usbserial_ring_buffer_used(&port->read_ring));
+    }
+
+    if (port->read_execute && (port->read_max_backlog > 0))
+    {
+        return port->read_queue_bytes >= port->read_max_backlog;
+    }
+
+    return 0;
+}
+
+/* Transfers which were delivered but could not be resubmitted yet,
+ * because no free buffer was available or back-pressure paused the
+ * reader, are parked. They are always consecutive (in submission
+ * order), starting at read_parked_first_idx, and are resubmitted in
+ * that order, which keeps the order of completions equal to the
+ * order of the transfers. */
+static int usbserial_common_submit_parked_read_transfers(struct usbserial_port* port)
+{
+    unsigned int timeout_millis = usbserial_common_get_read_timeout(port);
+
+    while ((port->read_parked_count > 0)
+           && (!port->read_stopping)
+           && (!port->read_error_flag))
+    {
+        struct usbserial_read_transfer* read_transfer
+                = &port->read_transfers[port->read_parked_first_idx];
+        int submit_ret;
+
+        if (usbserial_common_read_backlog_full(port))
         {
-            cancel_ret = libusb_cancel_transfer(transfer);
-            if (0 == cancel_ret)
+            if (atomic_load(&port->read_paused)) return 0;
+
+            /* Check again after publishing the flag, so a consumer
+             * which made room meanwhile either sees the flag, or
+             * its room is seen here. */
+            atomic_store(&port->read_paused, 1);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (usbserial_common_read_backlog_full(port))
             {
-#ifdef _WIN32
-                DWORD wait_ret = WaitForSingleObject(port->cancel_event, INFINITE);
-                assert(WAIT_OBJECT_0 == wait_ret);
-#else
-                pthread_ret = pthread_cond_wait(&port->cancel_cond, &port->mutex);
-                assert(0 == pthread_ret);
-#endif
+                ++port->read_stats.pauses;
+                return 0;
             }
         }
+        atomic_store(&port->read_paused, 0);
 
-#ifdef _WIN32
-        LeaveCriticalSection(&port->mutex);
-#else
-        pthread_ret = pthread_mutex_unlock(&port->mutex);
-        assert(0 == pthread_ret);
-#endif
-    } while ((0 == read_error_flag_set) && (LIBUSB_ERROR_NOT_FOUND == cancel_ret));
+        if (!read_transfer->buffer)
+        {
+            read_transfer->buffer = usbserial_common_take_read_buffer(port);
+            if (!read_transfer->buffer) break;
+        }
 
-    return cancel_ret;
-}
+        port->read_parked_first_idx
+                = (port->read_parked_first_idx + 1) % port->read_transfers_count;
+        --port->read_parked_count;
 
-int usbserial_common_bulk_write(
-        libusb_device_handle* usb_device_handle,
-        unsigned char endpoint,
-        const void* data,
-        unsigned int bytes_count)
-{
-    assert(usb_device_handle);
-    assert((0 == bytes_count) || data);
+        read_transfer->transfer->buffer = read_transfer->buffer->data;
+        read_transfer->transfer->timeout = timeout_millis;
+        submit_ret = libusb_submit_transfer(read_transfer->transfer);
+        if (0 != submit_ret) return submit_ret;
+        read_transfer->submitted = 1;
+        ++port->read_transfers_pending;
+    }
 
-    int actual_length;
-    int bulk_transfer_ret;
+    return 0;
+}
 
-    if (0 == bytes_count) return 0;
+static void usbserial_common_signal_reader_idle(struct usbserial_port* port)
+{
+    if ((0 == port->read_transfers_pending) && (0 == port->read_callbacks_running))
+    {
+        usbserial_common_cond_broadcast(&port->cancel_cond);
+    }
+}
 
-    bulk_transfer_ret = libusb_bulk_transfer(
-                    usb_device_handle,
-                    endpoint,
-                    (unsigned char*) data,
-                    (int) bytes_count,
-                    &actual_length,
-                    0);
-    if ((0 == bulk_transfer_ret) || (bulk_transfer_ret == LIBUSB_ERROR_TIMEOUT))
+static void usbserial_common_call_read_cb(
+        struct usbserial_port* port,
+        void* data,
+        unsigned int count,
+        uint64_t timestamp_micros)
+{
+    if (port->read_cb_ex)
     {
-        if (((actual_length) < 0)
-                || (actual_length == ((int) bytes_count))) return bulk_transfer_ret;
-        else return usbserial_common_bulk_write(
-                    usb_device_handle,
-                    endpoint,
-                    ((unsigned char*) data) + actual_length,
-                    bytes_count - actual_length);
+        port->read_cb_ex(data, count, timestamp_micros, port->cb_user_data);
     }
-    else return bulk_transfer_ret;
+    else
+    {
+        port->read_cb(data, count, port->cb_user_data);
+    }
+}
+
+static void usbserial_common_flush_read_coalescing(struct usbserial_port* port)
+{
+    if (port->read_coalesce_count > 0)
+    {
+        usbserial_common_call_read_cb(
+                    port,
+                    port->read_coalesce_buffer,
+                    port->read_coalesce_count,
+                    port->read_coalesce_first_micros);
+        port->read_coalesce_count = 0;
+    }
+}
+
+/* Collect received data for read_cb. Also called for completions
+ * without data, to check the deadline of the collected data. */
+static void usbserial_common_coalesce_read_data(
+        struct usbserial_port* port,
+        const unsigned char* data,
+        unsigned int count,
+        uint64_t timestamp_micros)
+{
+    if (count > 0)
+    {
+        if (port->read_coalesce_count + count > port->read_coalesce_capacity)
+        {
+            usbserial_common_flush_read_coalescing(port);
+        }
+
+        if (0 == port->read_coalesce_count)
+        {
+            if (count >= port->read_coalesce_min_bytes)
+            {
+                /* Nothing to collect, avoid the copy. */
+                usbserial_common_call_read_cb(port, (void*) data, count, timestamp_micros);
+                return;
+            }
+            port->read_coalesce_first_micros = timestamp_micros;
+        }
+
+        memcpy(port->read_coalesce_buffer + port->read_coalesce_count, data, count);
+        port->read_coalesce_count += count;
+    }
+
+    if ((port->read_coalesce_count >= port->read_coalesce_min_bytes)
+            || ((port->read_coalesce_count > 0)
+                && (timestamp_micros - port->read_coalesce_first_micros
+                    >= port->read_coalesce_max_delay_micros)))
+    {
+        usbserial_common_flush_read_coalescing(port);
+    }
+}
+
+/* Pass received data to the application. Called without the lock,
+ * calls are serialized per port. Returns the count of bytes dropped
+ * by the back-pressure policy, and the backlog in out_backlog. */
+static unsigned int usbserial_common_consume_read_buffer(
+        struct usbserial_port* port,
+        struct usbserial_buffer* buffer,
+        int lend,
+        size_t* out_backlog)
+{
+    unsigned int count = buffer->length;
+    unsigned int dropped = 0;
+
+    *out_backlog = 0;
+
+    if (port->read_ring.data)
+    {
+        if (count > 0)
+        {
+            size_t used = usbserial_ring_buffer_used(&port->read_ring);
+
+            /* Only the producer changes the watermark state, it is
+             * re-armed once the consumer fell below the watermark. */
+            if (used < port->read_backlog_watermark) port->read_backlog_above_watermark = 0;
+
+            if (USBSERIAL_BACKPRESSURE_DROP_OLDEST == port->read_backpressure)
+            {
+                dropped = (unsigned int) usbserial_ring_buffer_write_overwrite(
+                            &port->read_ring,
+                            buffer->data,
+                            count);
+            }
+            else
+            {
+                /* Data which does not fit into the ring is discarded,
+                 * with USBSERIAL_BACKPRESSURE_BLOCK there is room. */
+                dropped = count - (unsigned int) usbserial_ring_buffer_write(
+                            &port->read_ring,
+                            buffer->data,
+                            count);
+            }
+            usbserial_common_wake_read_ring(port, 0);
+
+            used = usbserial_ring_buffer_used(&port->read_ring);
+            *out_backlog = used;
+            if ((port->read_backlog_watermark > 0)
+                    && (!port->read_backlog_above_watermark)
+                    && (used >= port->read_backlog_watermark))
+            {
+                port->read_backlog_above_watermark = 1;
+                port->read_backlog_cb((unsigned int) used, port->cb_user_data);
+            }
+        }
+    }
+    else if (lend)
+    {
+        port->buffer_read_cb(buffer, port->cb_user_data);
+    }
+    else if (port->read_framer)
+    {
+        if (count > 0) usbserial_framer_process(port->read_framer, buffer->data, count);
+    }
+    else if (port->read_coalesce_buffer)
+    {
+        usbserial_common_coalesce_read_data(port, buffer->data, count, buffer->timestamp_micros);
+    }
+    else if (count > 0)
+    {
+        usbserial_common_call_read_cb(port, buffer->data, count, buffer->timestamp_micros);
+    }
+
+    return dropped;
+}
+
+/* Must be called with port->mutex locked. */
+static void usbserial_common_count_dropped_bytes(
+        struct usbserial_port* port,
+        unsigned int dropped)
+{
+    if (dropped > 0)
+    {
+        port->read_stats.bytes_dropped += dropped;
+        ++port->read_stats.drop_events;
+    }
+}
+
+/* Must be called with port->mutex locked. */
+static void usbserial_common_update_max_backlog(
+        struct usbserial_port* port,
+        size_t backlog)
+{
+    if (backlog > port->read_stats.max_backlog)
+    {
+        port->read_stats.max_backlog = (unsigned int) backlog;
+    }
+}
+
+/* Must be called with port->mutex locked, it is released meanwhile. */
+static void usbserial_common_process_read_buffer(
+        struct usbserial_port* port,
+        struct usbserial_buffer* buffer)
+{
+    int lend = (buffer->length > 0) && (!port->read_ring.data) && port->buffer_read_cb;
+    unsigned int dropped;
+    size_t backlog;
+
+    if (lend)
+    {
+        atomic_store(&buffer->ref_count, 1);
+        ++port->read_buffers_lent;
+    }
+
+    usbserial_common_mutex_unlock(&port->mutex);
+    dropped = usbserial_common_consume_read_buffer(port, buffer, lend, &backlog);
+    usbserial_common_mutex_lock(&port->mutex);
+
+    usbserial_common_count_dropped_bytes(port, dropped);
+    usbserial_common_update_max_backlog(port, backlog);
+
+    if (!lend)
+    {
+        usbserial_common_put_read_buffer(port, buffer);
+        if (0 != usbserial_common_submit_parked_read_transfers(port))
+        {
+            usbserial_common_fail_reader(port, LIBUSB_TRANSFER_ERROR);
+        }
+    }
+}
+
+/* Must be called with port->mutex locked. */
+static struct usbserial_buffer* usbserial_common_dequeue_read_buffer(struct usbserial_port* port)
+{
+    struct usbserial_buffer* buffer = port->read_queue_head;
+
+    port->read_queue_head = buffer->next_free;
+    if (!port->read_queue_head) port->read_queue_tail = NULL;
+
+    port->read_queue_bytes -= buffer->length;
+    if (port->read_queue_bytes < port->read_backlog_watermark)
+    {
+        port->read_backlog_above_watermark = 0;
+    }
+
+    return buffer;
+}
+
+/* Executor task, which processes the port's queued buffers in order. */
+static void usbserial_common_drain_read_queue(void* task_data)
+{
+    struct usbserial_port* port = (struct usbserial_port*) task_data;
+
+    usbserial_common_mutex_lock(&port->mutex);
+
+    while (port->read_queue_head)
+    {
+        struct usbserial_buffer* buffer = usbserial_common_dequeue_read_buffer(port);
+
+        if (port->read_stopping)
+        {
+            usbserial_common_put_read_buffer(port, buffer);
+            continue;
+        }
+
+        usbserial_common_process_read_buffer(port, buffer);
+    }
+
+    port->read_drain_scheduled = 0;
+    --port->read_callbacks_running;
+    usbserial_common_signal_reader_idle(port);
+
+    usbserial_common_mutex_unlock(&port->mutex);
+}
+
+/* Must be called with port->mutex locked. */
+static void usbserial_common_resubmit_read_transfers(struct usbserial_port* port)
+{
+    if (0 != usbserial_common_submit_parked_read_transfers(port))
+    {
+        usbserial_common_fail_reader(port, LIBUSB_TRANSFER_ERROR);
+    }
+}
+
+/* Queue a buffer for the executor, applying the back-pressure policy.
+ * Must be called with port->mutex locked, it is released meanwhile. */
+static void usbserial_common_queue_read_buffer(
+        struct usbserial_port* port,
+        struct usbserial_buffer* buffer)
+{
+    unsigned int count = buffer->length;
+
+    if ((port->read_max_backlog > 0) && (count > 0))
+    {
+        if (USBSERIAL_BACKPRESSURE_DROP_NEWEST == port->read_backpressure)
+        {
+            if (port->read_queue_bytes + count > port->read_max_backlog)
+            {
+                usbserial_common_count_dropped_bytes(port, count);
+                usbserial_common_put_read_buffer(port, buffer);
+                usbserial_common_resubmit_read_transfers(port);
+                return;
+            }
+        }
+        else if (USBSERIAL_BACKPRESSURE_DROP_OLDEST == port->read_backpressure)
+        {
+            while (port->read_queue_head
+                   && (port->read_queue_bytes + count > port->read_max_backlog))
+            {
+                struct usbserial_buffer* oldest = usbserial_common_dequeue_read_buffer(port);
+                usbserial_common_count_dropped_bytes(port, oldest->length);
+                usbserial_common_put_read_buffer(port, oldest);
+            }
+        }
+    }
+
+    buffer->next_free = NULL;
+    if (port->read_queue_tail) port->read_queue_tail->next_free = buffer;
+    else port->read_queue_head = buffer;
+    port->read_queue_tail = buffer;
+    port->read_queue_bytes += count;
+    usbserial_common_update_max_backlog(port, port->read_queue_bytes);
+
+    usbserial_common_resubmit_read_transfers(port);
+
+    if ((port->read_backlog_watermark > 0)
+            && (!port->read_backlog_above_watermark)
+            && (port->read_queue_bytes >= port->read_backlog_watermark))
+    {
+        unsigned int backlog = port->read_queue_bytes;
+
+        port->read_backlog_above_watermark = 1;
+
+        ++port->read_callbacks_running;
+        usbserial_common_mutex_unlock(&port->mutex);
+        port->read_backlog_cb(backlog, port->cb_user_data);
+        usbserial_common_mutex_lock(&port->mutex);
+        --port->read_callbacks_running;
+    }
+
+    if (!port->read_drain_scheduled)
+    {
+        port->read_drain_scheduled = 1;
+        ++port->read_callbacks_running;
+
+        usbserial_common_mutex_unlock(&port->mutex);
+        if (0 != port->read_execute(
+                    usbserial_common_drain_read_queue,
+                    port,
+                    port->read_executor_data))
+        {
+            /* Not accepted by the executor, drain here. */
+            usbserial_common_drain_read_queue(port);
+        }
+        usbserial_common_mutex_lock(&port->mutex);
+    }
+}
+
+void usbserial_common_update_modem_status(
+        struct usbserial_port* port,
+        unsigned int modem_status)
+{
+    assert(port);
+
+    int previous = atomic_exchange(&port->modem_status, (int) modem_status);
+
+    if ((previous != (int) modem_status) && port->modem_status_cb)
+    {
+        port->modem_status_changed = 1;
+    }
+}
+
+/* Return the index of the first XON or XOFF character in data, or
+ * count if there is none. Eight bytes are tested at a time: XON and
+ * XOFF differ in bit 1 only, so a byte matches if it equals XON with
+ * bit 1 cleared, which is found as a zero byte of the XOR. */
+static unsigned int usbserial_common_find_xon_xoff(
+        const unsigned char* data,
+        unsigned int count)
+{
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t highs = 0x8080808080808080ULL;
+    const uint64_t mask = ~(ones * (USBSERIAL_XON ^ USBSERIAL_XOFF));
+    const uint64_t pattern = ones * USBSERIAL_XON;
+    unsigned int i = 0;
+
+    for (; i + sizeof(uint64_t) <= count; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+
+        memcpy(&word, data + i, sizeof(word));
+        word = (word & mask) ^ pattern;
+        if ((word - ones) & ~word & highs) break;
+    }
+
+    for (; i < count; ++i)
+    {
+        if (USBSERIAL_XON == (data[i] & ~(USBSERIAL_XON ^ USBSERIAL_XOFF))) break;
+    }
+
+    return i;
+}
+
+void usbserial_common_filter_xon_xoff(
+        struct usbserial_port* port,
+        unsigned char* data,
+        unsigned int* count)
+{
+    assert(port);
+    assert(data);
+    assert(count);
+
+    unsigned int i = usbserial_common_find_xon_xoff(data, *count);
+    unsigned int out = i;
+    int xoff = port->write_xoff;
+
+    while (i < *count)
+    {
+        unsigned int run;
+
+        xoff = (USBSERIAL_XOFF == data[i]);
+        ++i;
+
+        run = usbserial_common_find_xon_xoff(data + i, *count - i);
+        memmove(data + out, data + i, run);
+        out += run;
+        i += run;
+    }
+
+    *count = out;
+    if (xoff != port->write_xoff) usbserial_common_set_write_xoff(port, xoff);
+}
+
+void usbserial_common_set_write_xoff(struct usbserial_port* port, int xoff)
+{
+    assert(port);
+
+    port->write_xoff = xoff;
+    if (!xoff) usbserial_common_cond_broadcast(&port->write_cond);
+}
+
+/* Must be called with port->mutex locked, it is released while
+ * modem_status_cb is called. */
+static void usbserial_common_notify_modem_status(struct usbserial_port* port)
+{
+    port->modem_status_changed = 0;
+
+    ++port->read_callbacks_running;
+    usbserial_common_mutex_unlock(&port->mutex);
+    port->modem_status_cb(
+                (unsigned int) atomic_load(&port->modem_status),
+                port->cb_user_data);
+    usbserial_common_mutex_lock(&port->mutex);
+    --port->read_callbacks_running;
+}
+
+/* Pass the data of a completed transfer to the application.
+ * Must be called with port->mutex locked. The transfer is resubmitted
+ * with a spare buffer first, then the lock is released while the data
+ * is passed on, so the application does not stall the USB IN pipe.
+ * With an executor, the data is queued and passed on by an executor
+ * task instead. */
+static void usbserial_common_deliver_read_transfer(
+        struct usbserial_port* port,
+        struct usbserial_read_transfer* read_transfer)
+{
+    struct usbserial_buffer* buffer = read_transfer->buffer;
+    unsigned int count = (unsigned int) read_transfer->transfer->actual_length;
+
+    /* Empty completions (idle timeouts) are passed to the
+     * postprocessor too, so the driver sees the port going idle. */
+    if (port->driver->read_data_postprocessor)
+    {
+        port->driver->read_data_postprocessor(port, buffer->data, &count);
+    }
+
+    if ((count > 0) && (USBSERIAL_FLOW_CONTROL_XON_XOFF == port->flow_control))
+    {
+        usbserial_common_filter_xon_xoff(port, buffer->data, &count);
+    }
+
+    /* Also for status-only packets, which carry no data. */
+    if (port->modem_status_changed) usbserial_common_notify_modem_status(port);
+
+    buffer->length = count;
+    buffer->timestamp_micros = read_transfer->timestamp_micros;
+    read_transfer->buffer = NULL;
+    port->read_stats.bytes_received += count;
+
+    assert(((port->read_parked_first_idx + port->read_parked_count)
+            % port->read_transfers_count)
+           == (unsigned int) (read_transfer - port->read_transfers));
+    ++port->read_parked_count;
+
+    /* The buffer is accounted for as queued or running before the
+     * transfer is resubmitted, see usbserial_common_read_backlog_full(). */
+    if (port->read_execute)
+    {
+        usbserial_common_queue_read_buffer(port, buffer);
+        return;
+    }
+
+    ++port->read_callbacks_running;
+    usbserial_common_resubmit_read_transfers(port);
+    usbserial_common_process_read_buffer(port, buffer);
+    --port->read_callbacks_running;
+}
+
+static void usbserial_common_default_read_transfer_callback(struct libusb_transfer* transfer)
+{
+    assert(transfer);
+
+    struct usbserial_read_transfer* read_transfer
+            = (struct usbserial_read_transfer*) transfer->user_data;
+    assert(read_transfer);
+    struct usbserial_port* port = read_transfer->port;
+    assert(port);
+
+    /* Taken before contending for the lock. */
+    read_transfer->timestamp_micros = usbserial_common_get_time_micros();
+
+    usbserial_common_mutex_lock(&port->mutex);
+
+    assert(read_transfer->submitted);
+    read_transfer->submitted = 0;
+    --port->read_transfers_pending;
+
+    if (port->read_stopping || port->read_error_flag)
+    {
+        /* The transfer was cancelled or completed while stopping,
+         * its data is dropped. */
+    }
+    else if ((LIBUSB_TRANSFER_COMPLETED == transfer->status)
+            || (LIBUSB_TRANSFER_TIMED_OUT == transfer->status))
+    {
+        read_transfer->completed = 1;
+
+        if ((LIBUSB_TRANSFER_TIMED_OUT == transfer->status) && (0 == transfer->actual_length))
+        {
+            if (port->read_idle_timeouts < 16) ++port->read_idle_timeouts;
+        }
+        else
+        {
+            port->read_idle_timeouts = 0;
+        }
+
+        /* Transfers of the same endpoint complete in submission order,
+         * but their callbacks are not guaranteed to be invoked in that
+         * order. Deliver in order, starting at the oldest transfer.
+         * Only one thread delivers at a time, it also delivers the
+         * transfers which complete while it has released the lock. */
+        if (!port->read_delivering)
+        {
+            port->read_delivering = 1;
+            while ((!port->read_stopping)
+                   && (!port->read_error_flag)
+                   && port->read_transfers[port->read_next_transfer_idx].completed)
+            {
+                struct usbserial_read_transfer* next_transfer
+                        = &port->read_transfers[port->read_next_transfer_idx];
+
+                next_transfer->completed = 0;
+                port->read_next_transfer_idx
+                        = (port->read_next_transfer_idx + 1) % port->read_transfers_count;
+
+                usbserial_common_deliver_read_transfer(port, next_transfer);
+            }
+            port->read_delivering = 0;
+        }
+    }
+    else if (LIBUSB_TRANSFER_CANCELLED != transfer->status)
+    {
+        usbserial_common_fail_reader(port, transfer->status);
+    }
+
+    usbserial_common_signal_reader_idle(port);
+
+    usbserial_common_mutex_unlock(&port->mutex);
+}
+
+void usbserial_common_release_read_buffer(struct usbserial_buffer* buffer)
+{
+    assert(buffer);
+
+    struct usbserial_port* port = buffer->port;
+    assert(port);
+
+    usbserial_common_mutex_lock(&port->mutex);
+
+    assert(port->read_buffers_lent > 0);
+    --port->read_buffers_lent;
+    usbserial_common_put_read_buffer(port, buffer);
+
+    if (port->read_transfers)
+    {
+        if (0 != usbserial_common_submit_parked_read_transfers(port))
+        {
+            usbserial_common_fail_reader(port, LIBUSB_TRANSFER_ERROR);
+        }
+    }
+
+    usbserial_common_mutex_unlock(&port->mutex);
+}
+
+void usbserial_common_resume_reader(struct usbserial_port* port)
+{
+    assert(port);
+
+    /* Pairs with the fence in usbserial_common_submit_parked_read_transfers(). */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!atomic_load(&port->read_paused)) return;
+
+    usbserial_common_mutex_lock(&port->mutex);
+    if (port->read_transfers)
+    {
+        if (0 != usbserial_common_submit_parked_read_transfers(port))
+        {
+            usbserial_common_fail_reader(port, LIBUSB_TRANSFER_ERROR);
+        }
+    }
+    usbserial_common_mutex_unlock(&port->mutex);
+}
+
+static void usbserial_common_free_spare_read_transfers(struct usbserial_port* port)
+{
+    unsigned int i;
+
+    if (port->read_spare_transfers)
+    {
+        for (i = 0; i < port->read_spare_transfers_count; ++i)
+        {
+            libusb_free_transfer(port->read_spare_transfers[i].transfer);
+        }
+        free(port->read_spare_transfers);
+    }
+
+    port->read_spare_transfers = NULL;
+    port->read_spare_transfers_count = 0;
+}
+
+static void usbserial_common_free_read_buffer_pool(struct usbserial_port* port)
+{
+    free(port->read_buffer_pool);
+    usbserial_common_aligned_free(port->read_buffer_pool_data);
+
+    port->read_buffer_pool = NULL;
+    port->read_buffer_pool_data = NULL;
+    port->read_buffer_pool_count = 0;
+    port->read_buffer_capacity = 0;
+    port->read_free_buffers = NULL;
+    port->read_transfer_size = 0;
+}
+
+void usbserial_common_free_read_buffers(struct usbserial_port* port)
+{
+    assert(port);
+    assert(!port->read_transfers);
+    assert(0 == port->read_buffers_lent);
+
+    usbserial_common_free_read_buffer_pool(port);
+    usbserial_common_free_spare_read_transfers(port);
+
+    free(port->read_coalesce_buffer);
+    port->read_coalesce_buffer = NULL;
+    port->read_coalesce_capacity = 0;
+    port->read_coalesce_count = 0;
+    free(port->read_coalesce_spare);
+    port->read_coalesce_spare = NULL;
+    port->read_coalesce_spare_capacity = 0;
+}
+
+/* Must be called with port->mutex locked. A pool of at least count
+ * buffers of at least size bytes is reused, e.g. the one allocated
+ * by usbserial_common_prealloc_read_pools(). */
+static int usbserial_common_alloc_read_buffers(
+        struct usbserial_port* port,
+        unsigned int count,
+        unsigned int size)
+{
+    size_t alignment = port->buffer_alignment;
+    unsigned int capacity;
+    unsigned int i;
+
+    if (port->read_buffer_pool
+            && (port->read_buffer_pool_count >= count)
+            && (port->read_buffer_capacity >= size))
+    {
+        port->read_transfer_size = size;
+        return 0;
+    }
+
+    /* Buffers still lent to the application can't be reallocated. */
+    if (port->read_buffers_lent > 0) return USBSERIAL_ERROR_ILLEGAL_STATE;
+
+    usbserial_common_free_read_buffer_pool(port);
+
+    /* Each buffer starts at a multiple of the alignment. */
+    capacity = (unsigned int) (((size + alignment - 1) / alignment) * alignment);
+
+    port->read_buffer_pool = (struct usbserial_buffer*) calloc(
+                count,
+                sizeof(struct usbserial_buffer));
+    port->read_buffer_pool_data = (unsigned char*) usbserial_common_aligned_alloc(
+                (size_t) count * capacity,
+                alignment);
+    if ((!port->read_buffer_pool) || (!port->read_buffer_pool_data))
+    {
+        usbserial_common_free_read_buffer_pool(port);
+        return USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
+    }
+    port->read_buffer_pool_count = count;
+    port->read_buffer_capacity = capacity;
+    port->read_transfer_size = size;
+
+    for (i = 0; i < count; ++i)
+    {
+        struct usbserial_buffer* buffer = &port->read_buffer_pool[i];
+        buffer->port = port;
+        buffer->data = port->read_buffer_pool_data + ((size_t) i * capacity);
+        buffer->length = 0;
+        atomic_init(&buffer->ref_count, 0);
+        usbserial_common_put_read_buffer(port, buffer);
+    }
+
+    return 0;
+}
+
+/* The spare transfers of the last run of the reader are reused, if
+ * their count matches. */
+static int usbserial_common_alloc_read_transfers(
+        struct usbserial_port* port,
+        unsigned int count,
+        struct usbserial_read_transfer** out_read_transfers)
+{
+    struct usbserial_read_transfer* read_transfers;
+    unsigned int i;
+
+    if (port->read_spare_transfers && (port->read_spare_transfers_count == count))
+    {
+        *out_read_transfers = port->read_spare_transfers;
+        port->read_spare_transfers = NULL;
+        port->read_spare_transfers_count = 0;
+        return 0;
+    }
+
+    usbserial_common_free_spare_read_transfers(port);
+
+    read_transfers = (struct usbserial_read_transfer*) calloc(
+                count,
+                sizeof(struct usbserial_read_transfer));
+    if (!read_transfers) return USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
+
+    for (i = 0; i < count; ++i)
+    {
+        read_transfers[i].transfer = libusb_alloc_transfer(0);
+        if (!read_transfers[i].transfer)
+        {
+            while (i-- > 0) libusb_free_transfer(read_transfers[i].transfer);
+            free(read_transfers);
+            return USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
+        }
+    }
+
+    *out_read_transfers = read_transfers;
+    return 0;
+}
+
+/* Keep the reader's transfers as spare transfers for its next start. */
+static void usbserial_common_free_read_transfers(struct usbserial_port* port)
+{
+    unsigned int i;
+
+    if (port->read_transfers)
+    {
+        for (i = 0; i < port->read_transfers_count; ++i)
+        {
+            struct usbserial_read_transfer* read_transfer = &port->read_transfers[i];
+            if (read_transfer->buffer)
+            {
+                usbserial_common_put_read_buffer(port, read_transfer->buffer);
+                read_transfer->buffer = NULL;
+            }
+        }
+
+        usbserial_common_free_spare_read_transfers(port);
+        port->read_spare_transfers = port->read_transfers;
+        port->read_spare_transfers_count = port->read_transfers_count;
+    }
+
+    port->read_transfers = NULL;
+    port->read_transfers_count = 0;
+}
+
+int usbserial_common_prealloc_read_pools(
+        struct usbserial_port* port,
+        unsigned int buffers_count)
+{
+    assert(port);
+
+    struct usbserial_read_transfer* read_transfers;
+    unsigned int size;
+    int ret;
+
+    if (port->read_transfers) return USBSERIAL_ERROR_ILLEGAL_STATE;
+
+    ret = usbserial_common_alloc_read_transfers(port, port->read_queue_depth, &read_transfers);
+    if (0 != ret) return ret;
+    port->read_spare_transfers = read_transfers;
+    port->read_spare_transfers_count = port->read_queue_depth;
+
+    /* The reader rounds the buffer size up to a multiple of the
+     * endpoint's packet size, which is unknown yet. */
+    size = ((port->read_buffer_size + READ_BUFFER_SIZE_GRANULARITY - 1)
+            / READ_BUFFER_SIZE_GRANULARITY) * READ_BUFFER_SIZE_GRANULARITY;
+
+    usbserial_common_mutex_lock(&port->mutex);
+    ret = usbserial_common_alloc_read_buffers(port, buffers_count, size);
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    return ret;
+}
+
+/* Keep the coalescing buffer of a reader which failed to start as the
+ * spare for the next start, discarding its data. */
+static void usbserial_common_release_coalesce_buffer(struct usbserial_port* port)
+{
+    if (!port->read_coalesce_buffer) return;
+
+    free(port->read_coalesce_spare);
+    port->read_coalesce_spare = port->read_coalesce_buffer;
+    port->read_coalesce_spare_capacity = port->read_coalesce_capacity;
+    port->read_coalesce_buffer = NULL;
+    port->read_coalesce_capacity = 0;
+    port->read_coalesce_count = 0;
+}
+
+int usbserial_common_start_reader(
+        struct usbserial_port* port,
+        unsigned char endpoint)
+{
+    assert(port);
+    assert(port->read_cb
+           || port->read_cb_ex
+           || port->buffer_read_cb
+           || (port->read_ring_size > 0)
+           || port->read_framer);
+    assert(port->read_queue_depth > 0);
+
+    struct usbserial_read_transfer* read_transfers;
+    unsigned int i;
+    unsigned int transfer_size;
+    unsigned int buffers_count;
+    int coalesce;
+    int max_packet_size;
+    int ret = 0;
+
+    if (port->read_transfers) return USBSERIAL_ERROR_ILLEGAL_STATE;
+
+    if ((port->read_ring_size > 0) && (!port->read_ring.data))
+    {
+        ret = usbserial_ring_buffer_init(&port->read_ring, port->read_ring_size);
+        if (0 != ret) return ret;
+    }
+
+    /* A transfer which is not a multiple of the packet size
+     * overflows if the device sends a full packet at its end. */
+    transfer_size = port->read_buffer_size;
+    max_packet_size = libusb_get_max_packet_size(port->usb_device, endpoint);
+    if (max_packet_size > 0)
+    {
+        if (port->read_timestamp_per_packet)
+        {
+            /* One completion, and timestamp, per packet. */
+            transfer_size = (unsigned int) max_packet_size;
+        }
+        else
+        {
+            transfer_size = ((transfer_size + max_packet_size - 1) / max_packet_size)
+                    * max_packet_size;
+        }
+    }
+
+    /* Spare buffers let transfers be resubmitted while the application
+     * processes data. */
+    buffers_count = port->read_queue_depth;
+    if (port->buffer_read_cb) buffers_count += port->read_lend_pool_size;
+    else if (port->read_execute) buffers_count += port->read_queue_depth;
+    else buffers_count += 1;
+
+    coalesce = (port->read_coalesce_min_bytes > 0)
+            && (!port->read_ring_size)
+            && (!port->buffer_read_cb)
+            && (!port->read_framer);
+
+    /* Blocking needs room for at least one transfer. */
+    if ((USBSERIAL_BACKPRESSURE_BLOCK == port->read_backpressure)
+            && port->read_ring.data
+            && (port->read_ring.capacity < transfer_size))
+    {
+        return USBSERIAL_ERROR_INVALID_PARAMETER;
+    }
+
+    usbserial_common_mutex_lock(&port->mutex);
+    ret = usbserial_common_alloc_read_buffers(port, buffers_count, transfer_size);
+    usbserial_common_mutex_unlock(&port->mutex);
+    if (0 != ret) return ret;
+
+    if (coalesce)
+    {
+        unsigned int capacity = port->read_coalesce_min_bytes + transfer_size;
+
+        /* The buffer of the last run is reused, if it is large enough. */
+        if (port->read_coalesce_spare && (port->read_coalesce_spare_capacity >= capacity))
+        {
+            port->read_coalesce_buffer = port->read_coalesce_spare;
+            port->read_coalesce_capacity = port->read_coalesce_spare_capacity;
+            port->read_coalesce_spare = NULL;
+            port->read_coalesce_spare_capacity = 0;
+        }
+        else
+        {
+            port->read_coalesce_capacity = capacity;
+            port->read_coalesce_buffer = (unsigned char*) malloc(capacity);
+            if (!port->read_coalesce_buffer) return USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
+        }
+        port->read_coalesce_count = 0;
+    }
+
+    ret = usbserial_common_alloc_read_transfers(port, port->read_queue_depth, &read_transfers);
+    if (0 != ret)
+    {
+        usbserial_common_release_coalesce_buffer(port);
+        return ret;
+    }
+
+    for (i = 0; i < port->read_queue_depth; ++i)
+    {
+        struct usbserial_read_transfer* read_transfer = &read_transfers[i];
+        read_transfer->port = port;
+        read_transfer->buffer = NULL;
+        read_transfer->submitted = 0;
+        read_transfer->completed = 0;
+        read_transfer->timestamp_micros = 0;
+
+        libusb_fill_bulk_transfer(
+                    read_transfer->transfer,
+                    port->usb_device_handle,
+                    endpoint,
+                    NULL,
+                    (int) transfer_size,
+                    usbserial_common_default_read_transfer_callback,
+                    read_transfer,
+                    DEFAULT_READ_TIMEOUT_MILLIS);
+    }
+
+    usbserial_common_mutex_lock(&port->mutex);
+
+    port->read_transfers = read_transfers;
+    port->read_transfers_count = port->read_queue_depth;
+    port->read_transfers_pending = 0;
+    port->read_next_transfer_idx = 0;
+    port->read_parked_first_idx = 0;
+    port->read_parked_count = port->read_transfers_count;
+    port->read_callbacks_running = 0;
+    port->read_delivering = 0;
+    port->read_stopping = 0;
+    port->read_max_packet_size = (max_packet_size > 0) ? (unsigned int) max_packet_size : 0;
+    port->read_idle_timeouts = 0;
+    port->read_queue_bytes = 0;
+    port->read_backlog_above_watermark = 0;
+    atomic_store(&port->read_paused, 0);
+    atomic_store(&port->modem_status, -1);
+    port->modem_status_changed = 0;
+    usbserial_common_set_write_xoff(port, 0);
+    usbserial_common_update_read_timeout(port);
+    port->read_error_flag = 0;
+    atomic_store(&port->read_ring_status, 0);
+    usbserial_common_update_read_event(port);
+    if (port->read_framer) usbserial_framer_reset(port->read_framer);
+
+    ret = usbserial_common_submit_parked_read_transfers(port);
+    if (0 != ret)
+    {
+        port->read_stopping = 1;
+        usbserial_common_cancel_read_transfers(port);
+        while (port->read_transfers_pending > 0)
+        {
+            usbserial_common_cond_wait(&port->cancel_cond, &port->mutex);
+        }
+        usbserial_common_free_read_transfers(port);
+        usbserial_common_release_coalesce_buffer(port);
+    }
+
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    return ret;
+}
+
+int usbserial_common_stop_reader(struct usbserial_port* port)
+{
+    assert(port);
+
+    int ret;
+
+    usbserial_common_mutex_lock(&port->mutex);
+
+    if (!port->read_transfers)
+    {
+        usbserial_common_mutex_unlock(&port->mutex);
+        return USBSERIAL_ERROR_ILLEGAL_STATE;
+    }
+
+    port->read_stopping = 1;
+    ret = usbserial_common_cancel_read_transfers(port);
+    while ((port->read_transfers_pending > 0) || (port->read_callbacks_running > 0))
+    {
+        usbserial_common_cond_wait(&port->cancel_cond, &port->mutex);
+    }
+
+    usbserial_common_free_read_transfers(port);
+    atomic_store(&port->modem_status, -1);
+    /* No XON can be received anymore. */
+    usbserial_common_set_write_xoff(port, 0);
+
+    if (port->read_coalesce_buffer)
+    {
+        /* The buffer is detached from the port, so the collected data
+         * can be passed to read_cb without the lock. */
+        unsigned char* coalesce_buffer = port->read_coalesce_buffer;
+        unsigned int coalesce_capacity = port->read_coalesce_capacity;
+        unsigned int coalesce_count = port->read_coalesce_count;
+        uint64_t coalesce_first_micros = port->read_coalesce_first_micros;
+
+        port->read_coalesce_buffer = NULL;
+        port->read_coalesce_capacity = 0;
+        port->read_coalesce_count = 0;
+
+        if (coalesce_count > 0)
+        {
+            ++port->read_callbacks_running;
+            usbserial_common_mutex_unlock(&port->mutex);
+            usbserial_common_call_read_cb(
+                        port,
+                        coalesce_buffer,
+                        coalesce_count,
+                        coalesce_first_micros);
+            usbserial_common_mutex_lock(&port->mutex);
+            --port->read_callbacks_running;
+            usbserial_common_signal_reader_idle(port);
+        }
+
+        free(port->read_coalesce_spare);
+        port->read_coalesce_spare = coalesce_buffer;
+        port->read_coalesce_spare_capacity = coalesce_capacity;
+    }
+
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    usbserial_common_wake_read_ring(port, USBSERIAL_ERROR_ILLEGAL_STATE);
+
+    return ret;
+}
+
+static void usbserial_common_sync_write_callback(struct libusb_transfer* transfer)
+{
+    struct usbserial_port* port = (struct usbserial_port*) transfer->user_data;
+
+    usbserial_common_mutex_lock(&port->mutex);
+    port->write_sync_completed = 1;
+    usbserial_common_cond_broadcast(&port->write_cond);
+    usbserial_common_mutex_unlock(&port->mutex);
+}
+
+/* Returns a nonzero value, if the device of the port belongs to ctx.
+ * libusb does not tell the context of a device handle, so the device
+ * is looked up in the device list of ctx, once per context. */
+static int usbserial_common_device_in_context(
+        struct usbserial_port* port,
+        libusb_context* ctx)
+{
+    libusb_device* device = libusb_get_device(port->usb_device_handle);
+    libusb_device** devices;
+    ssize_t devices_count, i;
+    int matches = 0;
+
+    usbserial_common_mutex_lock(&port->mutex);
+    if (port->write_sync_ctx_checked && (port->write_sync_ctx == ctx))
+    {
+        matches = port->write_sync_ctx_matches;
+        usbserial_common_mutex_unlock(&port->mutex);
+        return matches;
+    }
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    devices_count = libusb_get_device_list(ctx, &devices);
+    if (devices_count < 0) return 0;
+    for (i = 0; i < devices_count; ++i)
+    {
+        if (devices[i] == device)
+        {
+            matches = 1;
+            break;
+        }
+    }
+    libusb_free_device_list(devices, 1);
+
+    usbserial_common_mutex_lock(&port->mutex);
+    port->write_sync_ctx = ctx;
+    port->write_sync_ctx_checked = 1;
+    port->write_sync_ctx_matches = matches;
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    return matches;
+}
+
+/* Same as libusb_bulk_transfer(), but with the port's preallocated
+ * transfer, if the library's event thread completes it, i.e. it runs
+ * with the context of the device. The wait is
+ * bounded: the transfer is cancelled, if it is not completed by its
+ * timeout, and its events are handled by the caller, if the event
+ * thread is stopped meanwhile. */
+static int usbserial_common_sync_bulk_transfer(
+        struct usbserial_port* port,
+        unsigned char endpoint,
+        unsigned char* data,
+        int length,
+        int* actual_length,
+        unsigned int timeout_millis)
+{
+    struct libusb_transfer* transfer = port->write_sync_transfer;
+    libusb_context* ctx = usbserial_event_thread_get_context();
+    unsigned int poll_millis = usbserial_event_thread_get_poll_timeout_millis();
+    uint64_t cancel_deadline;
+    int cancelled = 0;
+    int ret;
+
+    if ((!transfer)
+            || (!usbserial_event_thread_is_running())
+            || usbserial_event_thread_is_current()
+            || (!usbserial_common_device_in_context(port, ctx)))
+    {
+        return libusb_bulk_transfer(
+                    port->usb_device_handle,
+                    endpoint,
+                    data,
+                    length,
+                    actual_length,
+                    timeout_millis);
+    }
+
+    libusb_fill_bulk_transfer(
+                transfer,
+                port->usb_device_handle,
+                endpoint,
+                data,
+                length,
+                usbserial_common_sync_write_callback,
+                port,
+                timeout_millis);
+
+    /* libusb times the transfer out by itself, the cancellation is
+     * the fallback one poll period later. */
+    cancel_deadline = (0 == timeout_millis)
+            ? 0 : usbserial_common_get_deadline_micros(timeout_millis + poll_millis);
+
+    usbserial_common_mutex_lock(&port->mutex);
+    port->write_sync_completed = 0;
+    ret = libusb_submit_transfer(transfer);
+    if (0 == ret)
+    {
+        while ((!port->write_sync_completed) && usbserial_event_thread_is_running())
+        {
+            if ((!cancelled)
+                    && (0 != cancel_deadline)
+                    && (usbserial_common_get_time_micros() >= cancel_deadline))
+            {
+                libusb_cancel_transfer(transfer);
+                cancelled = 1;
+            }
+            usbserial_common_cond_timedwait(&port->write_cond, &port->mutex, poll_millis);
+        }
+
+        /* The event thread was stopped, so nobody else completes the
+         * transfer, like libusb_bulk_transfer() its events are handled
+         * here. */
+        if (!port->write_sync_completed)
+        {
+            usbserial_common_mutex_unlock(&port->mutex);
+            while (!port->write_sync_completed)
+            {
+                struct timeval tv;
+                tv.tv_sec = poll_millis / 1000;
+                tv.tv_usec = (poll_millis % 1000) * 1000;
+                libusb_handle_events_timeout_completed(ctx, &tv, &port->write_sync_completed);
+            }
+            usbserial_common_mutex_lock(&port->mutex);
+        }
+    }
+    usbserial_common_mutex_unlock(&port->mutex);
+    if (0 != ret) return ret;
+
+    *actual_length = transfer->actual_length;
+
+    return usbserial_common_get_transfer_error(transfer->status);
+}
+
+int usbserial_common_bulk_write(
+        struct usbserial_port* port,
+        unsigned char endpoint,
+        const void* data,
+        unsigned int bytes_count,
+        unsigned int timeout_millis,
+        unsigned int* out_bytes_written)
+{
+    assert(port);
+    assert((0 == bytes_count) || data);
+
+    uint64_t deadline = usbserial_common_get_deadline_micros(timeout_millis);
+    unsigned int bytes_written = 0;
+    int ret = 0;
+
+    /* A transfer can end early, e.g. by its timeout, the rest is
+     * sent by the next one until the deadline. */
+    while (bytes_written < bytes_count)
+    {
+        unsigned int transfer_timeout_millis;
+        int actual_length = 0;
+
+        ret = usbserial_common_get_remaining_millis(deadline, &transfer_timeout_millis);
+        if (0 != ret) break;
+
+        ret = usbserial_common_sync_bulk_transfer(
+                    port,
+                    endpoint,
+                    ((unsigned char*) data) + bytes_written,
+                    (int) (bytes_count - bytes_written),
+                    &actual_length,
+                    transfer_timeout_millis);
+        if (actual_length > 0) bytes_written += (unsigned int) actual_length;
+
+        if (LIBUSB_ERROR_TIMEOUT == ret)
+        {
+            /* Only the deadline ends the write. */
+            if (0 != deadline) continue;
+        }
+        if (0 != ret) break;
+    }
+
+    if (out_bytes_written) *out_bytes_written = bytes_written;
+
+    return ret;
 }
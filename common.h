@@ -27,20 +27,126 @@ along with libusbserial. If not, see <http://www.gnu.org/licenses/>.
 #include <endian.h>
 #endif
 
-void usbserial_common_init_bulk_read_transfer(
-        struct libusb_transfer* transfer,
-        unsigned char endpoint,
-        struct usbserial_port* port);
+/* Software flow control characters (DC1 and DC3). */
+#define USBSERIAL_XON 0x11
+#define USBSERIAL_XOFF 0x13
+
+void usbserial_common_mutex_lock(usbserial_mutex_t* mutex);
+void usbserial_common_mutex_unlock(usbserial_mutex_t* mutex);
+void usbserial_common_cond_wait(usbserial_cond_t* cond, usbserial_mutex_t* mutex);
+void usbserial_common_cond_broadcast(usbserial_cond_t* cond);
+void usbserial_common_cond_signal(usbserial_cond_t* cond);
+/* Returns zero if the condition was signalled (or on a spurious wakeup)
+ * and a nonzero value if the timeout expired. */
+int usbserial_common_cond_timedwait(
+        usbserial_cond_t* cond,
+        usbserial_mutex_t* mutex,
+        unsigned int timeout_millis);
+
+/* Monotonic time in microseconds. */
+uint64_t usbserial_common_get_time_micros(void);
+
+/* Returns the deadline timeout_millis milliseconds from now, or zero
+ * for no timeout if timeout_millis is zero. */
+uint64_t usbserial_common_get_deadline_micros(unsigned int timeout_millis);
+
+/* Store the milliseconds left until the deadline (at least 1, or zero
+ * for no deadline) in out_timeout_millis. Returns LIBUSB_ERROR_TIMEOUT
+ * if the deadline passed. */
+int usbserial_common_get_remaining_millis(
+        uint64_t deadline_micros,
+        unsigned int* out_timeout_millis);
+
+/* Allocate size bytes aligned to alignment (a power of two), which
+ * must be freed with usbserial_common_aligned_free(). */
+void* usbserial_common_aligned_alloc(size_t size, size_t alignment);
+void usbserial_common_aligned_free(void* ptr);
+
+/* Returns the libusb error code of a transfer status. */
+int usbserial_common_get_transfer_error(enum libusb_transfer_status status);
+
+/* Create the port's readiness fd, see
+ * usbserial_port_get_read_event_fd(). Must be called with
+ * port->mutex locked. Returns the fd, or an error code on failure. */
+int usbserial_common_open_read_event(struct usbserial_port* port);
+void usbserial_common_close_read_event(struct usbserial_port* port);
+/* Make the readiness fd unreadable if no buffered data and no read
+ * status is pending anymore. Called by the consumer. */
+void usbserial_common_update_read_event(struct usbserial_port* port);
+
+/* Returns the count of bits on the line per character, including
+ * start, parity and stop bits (1.5 stop bits count as 2). */
+unsigned int usbserial_common_get_bits_per_char(const struct usbserial_line_config* line_config);
+
+/* Recalculate the bulk IN transfer timeout from the line
+ * configuration, see usbserial_port_set_read_timeout().
+ * Must be called with port->mutex locked. */
+void usbserial_common_update_read_timeout(struct usbserial_port* port);
+
+/* Allocate (or reuse) and submit port->read_queue_depth bulk IN transfers
+ * for the endpoint. Completed transfers, empty ones included, are passed
+ * to the driver's read_data_postprocessor, and the ones with data to
+ * read_cb, in submission order. */
+int usbserial_common_start_reader(
+        struct usbserial_port* port,
+        unsigned char endpoint);
+
+/* Cancel all bulk IN transfers of the reader, and wait for their
+ * callbacks. The transfers are kept for the next start. */
+int usbserial_common_stop_reader(struct usbserial_port* port);
+
+/* Resubmit the bulk IN transfers, if the reader was paused by
+ * USBSERIAL_BACKPRESSURE_BLOCK and there is room again. Called by
+ * the consumer of buffered reading. */
+void usbserial_common_resume_reader(struct usbserial_port* port);
 
-int usbserial_common_cancel_read_transfer_sync(
+/* Store the modem status received by the reader, see
+ * usbserial_get_modem_status(). Called by the driver's
+ * read_data_postprocessor, with port->mutex locked. */
+void usbserial_common_update_modem_status(
         struct usbserial_port* port,
-        struct libusb_transfer* transfer);
+        unsigned int modem_status);
+
+/* Remove XON and XOFF characters from the count bytes of data, and
+ * hold back or resume writing accordingly. Must be called with
+ * port->mutex locked. */
+void usbserial_common_filter_xon_xoff(
+        struct usbserial_port* port,
+        unsigned char* data,
+        unsigned int* count);
+
+/* Set or clear port->write_xoff, and wake up the waiting writers.
+ * Must be called with port->mutex locked. */
+void usbserial_common_set_write_xoff(struct usbserial_port* port, int xoff);
 
+/* Return a buffer, which was lent to the application by
+ * buffer_read_cb, to the port's pool. */
+void usbserial_common_release_read_buffer(struct usbserial_buffer* buffer);
+
+/* Free the port's read buffer pool and spare transfers. The reader
+ * must be stopped and all buffers must have been released. */
+void usbserial_common_free_read_buffers(struct usbserial_port* port);
+
+/* Allocate the port's read_queue_depth bulk IN transfers and
+ * buffers_count read buffers ahead of usbserial_common_start_reader(),
+ * which reuses them, as it does across restarts. */
+int usbserial_common_prealloc_read_pools(
+        struct usbserial_port* port,
+        unsigned int buffers_count);
+
+/* Write data to the endpoint within timeout_millis milliseconds, or
+ * without a timeout if it is zero. The count of bytes accepted by the
+ * device is stored in out_bytes_written (can be NULL), also if the
+ * timeout expired (LIBUSB_ERROR_TIMEOUT is returned then). While the
+ * library's event thread runs, the port's preallocated transfer is
+ * used, so calls must be serialized by the writer's link. */
 int usbserial_common_bulk_write(
-        libusb_device_handle* usb_device_handle,
+        struct usbserial_port* port,
         unsigned char endpoint,
         const void* data,
-        unsigned int bytes_count);
+        unsigned int bytes_count,
+        unsigned int timeout_millis,
+        unsigned int* out_bytes_written);
 
 #ifdef __APPLE__
 #define usbserial_common_convert_to_le(x) OSSwapHostToLittleInt32(x)
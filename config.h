@@ -22,8 +22,21 @@ along with libusbserial. If not, see <http://www.gnu.org/licenses/>.
 
 #define DEFAULT_CONTROL_TIMEOUT_MILLIS 1000
 #define DEFAULT_READ_TIMEOUT_MILLIS 200
-
-#define READ_BUFFER_SIZE 256
+#define MIN_ADAPTIVE_READ_TIMEOUT_MILLIS 10
+#define MAX_IDLE_READ_TIMEOUT_MILLIS 1000
+
+#define DEFAULT_EVENT_THREAD_POLL_TIMEOUT_MILLIS 100
+
+#define DEFAULT_READ_BUFFER_SIZE 256
+#define DEFAULT_READ_QUEUE_DEPTH 4
+#define READ_BUFFER_SIZE_GRANULARITY 512
+#define DEFAULT_BUFFER_ALIGNMENT 64
+#define DEFAULT_WRITE_QUEUE_DEPTH 4
+/* Tuning constants, not protocol values: usbserial_writev() copies
+ * segments smaller than WRITE_GATHER_BUFFER_SIZE together, and
+ * synchronous writes are sent in pieces of WRITE_LANE_CHUNK_SIZE. */
+#define WRITE_GATHER_BUFFER_SIZE 512
+#define WRITE_LANE_CHUNK_SIZE 16384
 
 #if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01001234)
 #define HAS_LIBUSB_STRERROR 1
@@ -19,13 +19,18 @@ along with libusbserial. If not, see <http://www.gnu.org/licenses/>.
 
 #include "libusbserial.h"
 
+#include "common.h"
 #include "config.h"
 #include "driver.h"
 #include "drivers.h"
+#include "event_thread.h"
 #include "internal.h"
+#include "writer.h"
 
 #include <assert.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 
 struct usbserial_driver drivers[3];
 
@@ -136,6 +141,8 @@ int usbserial_port_init(
     int pthread_ret;
 #ifndef _WIN32
     int mutex_initialized = 0, cancel_cond_initialized = 0;
+    int read_ring_mutex_initialized = 0, read_ring_cond_initialized = 0;
+    int write_cond_initialized = 0;
 #endif
 
     if ((!out_port) || (!usb_device_handle)) return USBSERIAL_ERROR_INVALID_PARAMETER;
@@ -169,7 +176,10 @@ int usbserial_port_init(
     InitializeCriticalSection(&port->mutex);
     EnterCriticalSection(&port->mutex);
 
-    port->cancel_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    InitializeConditionVariable(&port->cancel_cond);
+    InitializeCriticalSection(&port->read_ring_mutex);
+    InitializeConditionVariable(&port->read_ring_cond);
+    InitializeConditionVariable(&port->write_cond);
 #else
     pthread_ret = pthread_mutex_init(&port->mutex, NULL);
     if (0 != pthread_ret)
@@ -193,6 +203,30 @@ int usbserial_port_init(
         goto fail;
     }
     cancel_cond_initialized = 1;
+
+    pthread_ret = pthread_mutex_init(&port->read_ring_mutex, NULL);
+    if (0 != pthread_ret)
+    {
+        ret = USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
+        goto fail;
+    }
+    read_ring_mutex_initialized = 1;
+
+    pthread_ret = pthread_cond_init(&port->read_ring_cond, NULL);
+    if (0 != pthread_ret)
+    {
+        ret = USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
+        goto fail;
+    }
+    read_ring_cond_initialized = 1;
+
+    pthread_ret = pthread_cond_init(&port->write_cond, NULL);
+    if (0 != pthread_ret)
+    {
+        ret = USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
+        goto fail;
+    }
+    write_cond_initialized = 1;
 #endif
 
     port->driver = driver;
@@ -200,11 +234,107 @@ int usbserial_port_init(
     port->usb_device = usb_device;
     port->usb_device_descriptor = usb_device_descriptor;
     port->port_idx = port_idx;
+    port->line_config.baud = 0;
+    port->line_config.data_bits = USBSERIAL_DATABITS_8;
+    port->line_config.stop_bits = USBSERIAL_STOPBITS_1;
+    port->line_config.parity = USBSERIAL_PARITY_NONE;
+    port->flow_control = USBSERIAL_FLOW_CONTROL_NONE;
     port->read_cb = read_cb;
+    port->read_cb_ex = NULL;
+    port->buffer_read_cb = NULL;
     port->read_error_cb = read_error_cb;
     port->cb_user_data = cb_user_data;
     port->driver_specific_data = NULL;
+    port->read_queue_depth = DEFAULT_READ_QUEUE_DEPTH;
+    port->read_buffer_size = DEFAULT_READ_BUFFER_SIZE;
+    port->read_timestamp_per_packet = 0;
+    port->read_timeout_override = -1;
+    port->read_timeout_millis = DEFAULT_READ_TIMEOUT_MILLIS;
+    port->read_idle_timeouts = 0;
+    port->read_max_packet_size = 0;
+    port->read_transfers = NULL;
+    port->read_transfers_count = 0;
+    port->read_transfers_pending = 0;
+    port->read_next_transfer_idx = 0;
+    port->read_parked_first_idx = 0;
+    port->read_parked_count = 0;
+    port->read_callbacks_running = 0;
+    port->read_delivering = 0;
+    port->read_execute = NULL;
+    port->read_executor_data = NULL;
+    port->read_queue_head = NULL;
+    port->read_queue_tail = NULL;
+    port->read_drain_scheduled = 0;
+    port->read_buffer_pool = NULL;
+    port->read_buffer_pool_data = NULL;
+    port->read_buffer_pool_count = 0;
+    port->read_lend_pool_size = 0;
+    port->read_free_buffers = NULL;
+    port->read_buffers_lent = 0;
+    port->read_transfer_size = 0;
+    port->read_buffer_capacity = 0;
+    port->read_spare_transfers = NULL;
+    port->read_spare_transfers_count = 0;
+    port->read_coalesce_spare = NULL;
+    port->read_coalesce_spare_capacity = 0;
+    port->buffer_alignment = DEFAULT_BUFFER_ALIGNMENT;
+    port->read_framer = NULL;
+    atomic_init(&port->modem_status, -1);
+    port->modem_status_cb = NULL;
+    port->modem_status_changed = 0;
+    port->read_coalesce_min_bytes = 0;
+    port->read_coalesce_max_delay_micros = 0;
+    port->read_coalesce_buffer = NULL;
+    port->read_coalesce_capacity = 0;
+    port->read_coalesce_count = 0;
+    port->read_coalesce_first_micros = 0;
+    port->read_backpressure = USBSERIAL_BACKPRESSURE_DROP_NEWEST;
+    port->read_max_backlog = 0;
+    port->read_backlog_watermark = 0;
+    port->read_backlog_cb = NULL;
+    port->read_backlog_above_watermark = 0;
+    port->read_queue_bytes = 0;
+    atomic_init(&port->read_paused, 0);
+    memset(&port->read_stats, 0, sizeof(port->read_stats));
+    port->read_stopping = 0;
     port->read_error_flag = 0;
+    port->read_ring_size = 0;
+    port->read_ring.data = NULL;
+    port->read_ring.capacity = 0;
+    atomic_init(&port->read_ring_waiting, 0);
+    atomic_init(&port->read_ring_status, 0);
+    atomic_init(&port->read_event_fd, -1);
+    port->read_event_write_fd = -1;
+    atomic_init(&port->read_event_signaled, 0);
+    port->write_endpoint = 0;
+    atomic_init(&port->write_timeout_millis, 0);
+    port->write_queue_depth = DEFAULT_WRITE_QUEUE_DEPTH;
+    port->write_transfers = NULL;
+    port->write_transfers_count = 0;
+    port->write_free_transfers = NULL;
+    port->write_transfers_pending = 0;
+    port->write_callbacks_running = 0;
+    port->write_coalesce_min_bytes = 0;
+    port->write_coalesce_max_delay_micros = 0;
+    port->write_coalesce_capacity = 0;
+    port->write_staging = NULL;
+    port->write_staged_count = 0;
+    port->write_staged_first_micros = 0;
+    port->write_staged_error = 0;
+    port->write_pacing_burst = 0;
+    port->write_pacing_byte_nanos = 0;
+    port->write_pacing_drained_nanos = 0;
+    memset(port->write_lane_owned, 0, sizeof(port->write_lane_owned));
+    port->write_link_busy = 0;
+    port->write_xoff = 0;
+    port->write_sync_transfer = NULL;
+    port->write_sync_completed = 0;
+    port->write_sync_ctx = NULL;
+    port->write_sync_ctx_checked = 0;
+    port->write_sync_ctx_matches = 0;
+    memset(port->write_lane_stats, 0, sizeof(port->write_lane_stats));
+    port->write_flusher_running = 0;
+    port->write_flusher_stopping = 0;
 
 #ifdef _WIN32
     LeaveCriticalSection(&port->mutex);
@@ -217,8 +347,19 @@ int usbserial_port_init(
     }
 #endif
 
+    port->write_sync_transfer = libusb_alloc_transfer(0);
+    if (!port->write_sync_transfer)
+    {
+        ret = USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
+        goto fail;
+    }
+
     ret = driver->port_init(port);
-    if (0 != ret) goto fail;
+    if (0 != ret)
+    {
+        libusb_free_transfer(port->write_sync_transfer);
+        goto fail;
+    }
 
     *out_port = port;
 
@@ -230,10 +371,8 @@ fail:
     if (port)
     {
 #ifdef _WIN32
-        if (port->cancel_event)
-        {
-            CloseHandle(port->cancel_event);
-        }
+        DeleteCriticalSection(&port->mutex);
+        DeleteCriticalSection(&port->read_ring_mutex);
 #else
         if (mutex_initialized)
         {
@@ -245,6 +384,21 @@ fail:
             pthread_ret = pthread_cond_destroy(&port->cancel_cond);
             assert(0 == pthread_ret);
         }
+        if (read_ring_mutex_initialized)
+        {
+            pthread_ret = pthread_mutex_destroy(&port->read_ring_mutex);
+            assert(0 == pthread_ret);
+        }
+        if (read_ring_cond_initialized)
+        {
+            pthread_ret = pthread_cond_destroy(&port->read_ring_cond);
+            assert(0 == pthread_ret);
+        }
+        if (write_cond_initialized)
+        {
+            pthread_ret = pthread_cond_destroy(&port->write_cond);
+            assert(0 == pthread_ret);
+        }
 #endif
         free(port);
     }
@@ -252,13 +406,71 @@ fail:
     return ret;
 }
 
+int usbserial_port_init_with_pools(
+        struct usbserial_port** out_port,
+        libusb_device_handle* usb_device_handle,
+        unsigned int port_idx,
+        usbserial_read_cb_fn read_cb,
+        usbserial_error_cb_fn read_error_cb,
+        void* cb_user_data,
+        const struct usbserial_pool_config* pool_config)
+{
+    struct usbserial_port* port;
+    unsigned int read_buffers;
+    int ret;
+
+    if ((!out_port) || (!pool_config)) return USBSERIAL_ERROR_INVALID_PARAMETER;
+
+    *out_port = NULL;
+
+    if (0 != (pool_config->buffer_alignment & (pool_config->buffer_alignment - 1)))
+    {
+        return USBSERIAL_ERROR_INVALID_PARAMETER;
+    }
+
+    ret = usbserial_port_init(
+                &port,
+                usb_device_handle,
+                port_idx,
+                read_cb,
+                read_error_cb,
+                cb_user_data);
+    if (0 != ret) return ret;
+
+    if (pool_config->read_transfers > 0) port->read_queue_depth = pool_config->read_transfers;
+    if (pool_config->read_buffer_size > 0) port->read_buffer_size = pool_config->read_buffer_size;
+    if (pool_config->write_transfers > 0) port->write_queue_depth = pool_config->write_transfers;
+    if (pool_config->buffer_alignment > 0) port->buffer_alignment = pool_config->buffer_alignment;
+
+    read_buffers = pool_config->read_buffers;
+    if (read_buffers <= port->read_queue_depth) read_buffers = port->read_queue_depth + 1;
+
+    ret = usbserial_common_prealloc_read_pools(port, read_buffers);
+    if (0 == ret) ret = usbserial_writer_prealloc(port);
+    if (0 != ret)
+    {
+        usbserial_port_deinit(port);
+        return ret;
+    }
+
+    *out_port = port;
+
+    return 0;
+}
+
 int usbserial_port_deinit(struct usbserial_port* port)
 {
     int deinit_ret;
 
     if (!port) return USBSERIAL_ERROR_INVALID_PARAMETER;
 
+    usbserial_writer_stop(port);
     deinit_ret = port->driver->port_deinit(port);
+    usbserial_common_free_read_buffers(port);
+    libusb_free_transfer(port->write_sync_transfer);
+    if (port->read_ring.data) usbserial_ring_buffer_deinit(&port->read_ring);
+    usbserial_framer_destroy(port->read_framer);
+    usbserial_common_close_read_event(port);
     free(port);
     return deinit_ret;
 }
@@ -267,20 +479,390 @@ int usbserial_port_set_line_config(
         struct usbserial_port* port,
         const struct usbserial_line_config* line_config)
 {
+    int ret;
+
     if (!port || !line_config) return USBSERIAL_ERROR_INVALID_PARAMETER;
 
-    return port->driver->port_set_line_config(port, line_config);
+    ret = port->driver->port_set_line_config(port, line_config);
+    if (0 != ret) return ret;
+
+    usbserial_common_mutex_lock(&port->mutex);
+    port->line_config = *line_config;
+    usbserial_common_update_read_timeout(port);
+    usbserial_writer_update_pacing(port);
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    return 0;
 }
 
-int usbserial_start_reader(struct usbserial_port* port)
+int usbserial_port_set_flow_control(
+        struct usbserial_port* port,
+        enum usbserial_flow_control flow_control)
 {
+    int ret;
+
     if (!port) return USBSERIAL_ERROR_INVALID_PARAMETER;
-    if (!port->read_cb) return USBSERIAL_ERROR_ILLEGAL_STATE;
 
-#ifdef _WIN32
-    BOOL set_event_ret = ResetEvent(port->cancel_event);
-    assert(set_event_ret);
-#endif
+    switch (flow_control)
+    {
+    case USBSERIAL_FLOW_CONTROL_NONE:
+    case USBSERIAL_FLOW_CONTROL_RTS_CTS:
+    case USBSERIAL_FLOW_CONTROL_DTR_DSR:
+    case USBSERIAL_FLOW_CONTROL_XON_XOFF:
+        break;
+
+    default:
+        return USBSERIAL_ERROR_INVALID_PARAMETER;
+    }
+
+    ret = port->driver->port_set_flow_control(port, flow_control);
+    if ((USBSERIAL_FLOW_CONTROL_XON_XOFF == flow_control)
+            && (USBSERIAL_ERROR_UNSUPPORTED_OPERATION == ret))
+    {
+        /* Handled by the reader and writer only. */
+        ret = port->driver->port_set_flow_control(port, USBSERIAL_FLOW_CONTROL_NONE);
+    }
+    if (0 != ret) return ret;
+
+    usbserial_common_mutex_lock(&port->mutex);
+    port->flow_control = flow_control;
+    if (USBSERIAL_FLOW_CONTROL_XON_XOFF != flow_control)
+    {
+        usbserial_common_set_write_xoff(port, 0);
+    }
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    return 0;
+}
+
+int usbserial_port_set_option(
+        struct usbserial_port* port,
+        enum usbserial_port_option option,
+        int value)
+{
+    if (!port) return USBSERIAL_ERROR_INVALID_PARAMETER;
+
+    if (!port->driver->port_set_option) return USBSERIAL_ERROR_UNSUPPORTED_OPERATION;
+
+    return port->driver->port_set_option(port, option, value);
+}
+
+int usbserial_port_set_read_timeout(
+        struct usbserial_port* port,
+        int timeout_millis)
+{
+    if (!port) return USBSERIAL_ERROR_INVALID_PARAMETER;
+
+    usbserial_common_mutex_lock(&port->mutex);
+    port->read_timeout_override = timeout_millis;
+    usbserial_common_update_read_timeout(port);
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    return 0;
+}
+
+int usbserial_port_set_read_queue_depth(
+        struct usbserial_port* port,
+        unsigned int depth)
+{
+    int ret = 0;
+
+    if ((!port) || (0 == depth)) return USBSERIAL_ERROR_INVALID_PARAMETER;
+
+    usbserial_common_mutex_lock(&port->mutex);
+    if (port->read_transfers) ret = USBSERIAL_ERROR_ILLEGAL_STATE;
+    else port->read_queue_depth = depth;
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    return ret;
+}
+
+int usbserial_port_set_read_buffer_size(
+        struct usbserial_port* port,
+        unsigned int size)
+{
+    int ret = 0;
+
+    if ((!port) || (0 == size)) return USBSERIAL_ERROR_INVALID_PARAMETER;
+
+    usbserial_common_mutex_lock(&port->mutex);
+    if (port->read_transfers) ret = USBSERIAL_ERROR_ILLEGAL_STATE;
+    else port->read_buffer_size = size;
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    return ret;
+}
+
+int usbserial_port_set_read_ring_size(
+        struct usbserial_port* port,
+        unsigned int size)
+{
+    int ret = 0;
+
+    if (!port) return USBSERIAL_ERROR_INVALID_PARAMETER;
+
+    usbserial_common_mutex_lock(&port->mutex);
+    if (port->read_transfers)
+    {
+        ret = USBSERIAL_ERROR_ILLEGAL_STATE;
+    }
+    else
+    {
+        if (port->read_ring.data) usbserial_ring_buffer_deinit(&port->read_ring);
+        port->read_ring_size = size;
+    }
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    return ret;
+}
+
+int usbserial_port_set_buffer_read_cb(
+        struct usbserial_port* port,
+        usbserial_buffer_read_cb_fn buffer_read_cb,
+        unsigned int pool_size)
+{
+    int ret = 0;
+
+    if (!port) return USBSERIAL_ERROR_INVALID_PARAMETER;
+
+    usbserial_common_mutex_lock(&port->mutex);
+    if (port->read_transfers)
+    {
+        ret = USBSERIAL_ERROR_ILLEGAL_STATE;
+    }
+    else
+    {
+        port->buffer_read_cb = buffer_read_cb;
+        port->read_lend_pool_size = pool_size;
+    }
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    return ret;
+}
+
+void* usbserial_buffer_get_data(struct usbserial_buffer* buffer)
+{
+    assert(buffer);
+
+    return buffer->data;
+}
+
+unsigned int usbserial_buffer_get_size(const struct usbserial_buffer* buffer)
+{
+    assert(buffer);
+
+    return buffer->length;
+}
+
+uint64_t usbserial_buffer_get_timestamp_micros(const struct usbserial_buffer* buffer)
+{
+    assert(buffer);
+
+    return buffer->timestamp_micros;
+}
+
+void usbserial_buffer_retain(struct usbserial_buffer* buffer)
+{
+    assert(buffer);
+
+    atomic_fetch_add(&buffer->ref_count, 1);
+}
+
+void usbserial_buffer_release(struct usbserial_buffer* buffer)
+{
+    assert(buffer);
+
+    if (1 == atomic_fetch_sub(&buffer->ref_count, 1))
+    {
+        usbserial_common_release_read_buffer(buffer);
+    }
+}
+
+int usbserial_port_set_read_coalescing(
+        struct usbserial_port* port,
+        unsigned int min_bytes,
+        unsigned int max_delay_micros)
+{
+    int ret = 0;
+
+    if (!port) return USBSERIAL_ERROR_INVALID_PARAMETER;
+
+    usbserial_common_mutex_lock(&port->mutex);
+    if (port->read_transfers)
+    {
+        ret = USBSERIAL_ERROR_ILLEGAL_STATE;
+    }
+    else
+    {
+        port->read_coalesce_min_bytes = min_bytes;
+        port->read_coalesce_max_delay_micros = max_delay_micros;
+    }
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    return ret;
+}
+
+int usbserial_port_set_framer(
+        struct usbserial_port* port,
+        const struct usbserial_frame_config* config,
+        usbserial_frame_cb_fn frame_cb)
+{
+    struct usbserial_framer* framer = NULL;
+    int ret = 0;
+
+    if (!port) return USBSERIAL_ERROR_INVALID_PARAMETER;
+
+    if (config && (USBSERIAL_FRAME_NONE != config->mode))
+    {
+        ret = usbserial_framer_create(&framer, config, frame_cb, port->cb_user_data);
+        if (0 != ret) return ret;
+    }
+
+    usbserial_common_mutex_lock(&port->mutex);
+    if (port->read_transfers)
+    {
+        ret = USBSERIAL_ERROR_ILLEGAL_STATE;
+    }
+    else
+    {
+        usbserial_framer_destroy(port->read_framer);
+        port->read_framer = framer;
+        framer = NULL;
+    }
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    usbserial_framer_destroy(framer);
+
+    return ret;
+}
+
+int usbserial_port_set_read_cb_ex(
+        struct usbserial_port* port,
+        usbserial_read_cb_ex_fn read_cb_ex)
+{
+    int ret = 0;
+
+    if (!port) return USBSERIAL_ERROR_INVALID_PARAMETER;
+
+    usbserial_common_mutex_lock(&port->mutex);
+    if (port->read_transfers) ret = USBSERIAL_ERROR_ILLEGAL_STATE;
+    else port->read_cb_ex = read_cb_ex;
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    return ret;
+}
+
+int usbserial_port_set_read_timestamp_per_packet(
+        struct usbserial_port* port,
+        int enable)
+{
+    int ret = 0;
+
+    if (!port) return USBSERIAL_ERROR_INVALID_PARAMETER;
+
+    usbserial_common_mutex_lock(&port->mutex);
+    if (port->read_transfers) ret = USBSERIAL_ERROR_ILLEGAL_STATE;
+    else port->read_timestamp_per_packet = enable ? 1 : 0;
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    return ret;
+}
+
+uint64_t usbserial_get_timestamp_micros(void)
+{
+    return usbserial_common_get_time_micros();
+}
+
+int usbserial_port_set_read_executor(
+        struct usbserial_port* port,
+        usbserial_execute_fn execute,
+        void* executor_data)
+{
+    int ret = 0;
+
+    if (!port) return USBSERIAL_ERROR_INVALID_PARAMETER;
+
+    usbserial_common_mutex_lock(&port->mutex);
+    if (port->read_transfers)
+    {
+        ret = USBSERIAL_ERROR_ILLEGAL_STATE;
+    }
+    else
+    {
+        port->read_execute = execute;
+        port->read_executor_data = executor_data;
+    }
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    return ret;
+}
+
+int usbserial_port_set_backpressure(
+        struct usbserial_port* port,
+        enum usbserial_backpressure_policy policy,
+        unsigned int max_backlog_bytes,
+        unsigned int high_watermark_bytes,
+        usbserial_backlog_cb_fn backlog_cb)
+{
+    int ret = 0;
+
+    if (!port) return USBSERIAL_ERROR_INVALID_PARAMETER;
+    if ((high_watermark_bytes > 0) && (!backlog_cb)) return USBSERIAL_ERROR_INVALID_PARAMETER;
+
+    switch (policy)
+    {
+    case USBSERIAL_BACKPRESSURE_DROP_NEWEST:
+    case USBSERIAL_BACKPRESSURE_DROP_OLDEST:
+    case USBSERIAL_BACKPRESSURE_BLOCK:
+        break;
+
+    default:
+        return USBSERIAL_ERROR_INVALID_PARAMETER;
+    }
+
+    usbserial_common_mutex_lock(&port->mutex);
+    if (port->read_transfers)
+    {
+        ret = USBSERIAL_ERROR_ILLEGAL_STATE;
+    }
+    else
+    {
+        port->read_backpressure = policy;
+        port->read_max_backlog = max_backlog_bytes;
+        port->read_backlog_watermark = high_watermark_bytes;
+        port->read_backlog_cb = backlog_cb;
+    }
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    return ret;
+}
+
+int usbserial_port_get_read_stats(
+        struct usbserial_port* port,
+        struct usbserial_read_stats* stats,
+        int reset)
+{
+    if ((!port) || (!stats)) return USBSERIAL_ERROR_INVALID_PARAMETER;
+
+    usbserial_common_mutex_lock(&port->mutex);
+    *stats = port->read_stats;
+    if (reset) memset(&port->read_stats, 0, sizeof(port->read_stats));
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    return 0;
+}
+
+int usbserial_start_reader(struct usbserial_port* port)
+{
+    if (!port) return USBSERIAL_ERROR_INVALID_PARAMETER;
+    if ((!port->read_cb)
+            && (!port->read_cb_ex)
+            && (!port->buffer_read_cb)
+            && (0 == port->read_ring_size)
+            && (!port->read_framer))
+    {
+        return USBSERIAL_ERROR_ILLEGAL_STATE;
+    }
 
     return port->driver->start_reader(port);
 }
@@ -288,10 +870,158 @@ int usbserial_start_reader(struct usbserial_port* port)
 int usbserial_stop_reader(struct usbserial_port* port)
 {
     if (!port) return USBSERIAL_ERROR_INVALID_PARAMETER;
+    if (usbserial_event_thread_is_current()) return USBSERIAL_ERROR_ILLEGAL_STATE;
 
     return port->driver->stop_reader(port);
 }
 
+int usbserial_read(
+        struct usbserial_port* port,
+        void* data,
+        unsigned int bytes_count,
+        int timeout_millis)
+{
+    size_t read_count;
+    uint64_t deadline = 0;
+
+    if ((!port) || ((!data) && (bytes_count > 0))) return USBSERIAL_ERROR_INVALID_PARAMETER;
+    if (!port->read_ring.data) return USBSERIAL_ERROR_ILLEGAL_STATE;
+
+    read_count = usbserial_ring_buffer_read(&port->read_ring, data, bytes_count);
+    if ((read_count > 0) || (0 == bytes_count) || (0 == timeout_millis))
+    {
+        int status = atomic_load(&port->read_ring_status);
+        if ((0 == read_count) && (bytes_count > 0) && (0 != status))
+        {
+            /* The status is set after the last data was written. */
+            read_count = usbserial_ring_buffer_read(&port->read_ring, data, bytes_count);
+            if (0 == read_count) return status;
+        }
+
+        if (read_count > 0) usbserial_common_resume_reader(port);
+        usbserial_common_update_read_event(port);
+        return (int) read_count;
+    }
+
+    if (timeout_millis > 0)
+    {
+        deadline = usbserial_common_get_time_micros() + ((uint64_t) timeout_millis) * 1000;
+    }
+
+    usbserial_common_mutex_lock(&port->read_ring_mutex);
+    atomic_store(&port->read_ring_waiting, 1);
+    for (;;)
+    {
+        int status;
+
+        read_count = usbserial_ring_buffer_read(&port->read_ring, data, bytes_count);
+        if (read_count > 0) break;
+
+        status = atomic_load(&port->read_ring_status);
+        if (0 != status)
+        {
+            read_count = usbserial_ring_buffer_read(&port->read_ring, data, bytes_count);
+            if (read_count > 0) break;
+
+            atomic_store(&port->read_ring_waiting, 0);
+            usbserial_common_mutex_unlock(&port->read_ring_mutex);
+            return status;
+        }
+
+        if (timeout_millis < 0)
+        {
+            usbserial_common_cond_wait(&port->read_ring_cond, &port->read_ring_mutex);
+        }
+        else
+        {
+            uint64_t now = usbserial_common_get_time_micros();
+            if (now >= deadline) break;
+            usbserial_common_cond_timedwait(
+                        &port->read_ring_cond,
+                        &port->read_ring_mutex,
+                        (unsigned int) ((deadline - now + 999) / 1000));
+        }
+    }
+    atomic_store(&port->read_ring_waiting, 0);
+    usbserial_common_mutex_unlock(&port->read_ring_mutex);
+
+    if (read_count > 0) usbserial_common_resume_reader(port);
+    usbserial_common_update_read_event(port);
+
+    return (int) read_count;
+}
+
+int usbserial_port_get_read_event_fd(struct usbserial_port* port)
+{
+    int ret;
+
+    if (!port) return USBSERIAL_ERROR_INVALID_PARAMETER;
+
+    usbserial_common_mutex_lock(&port->mutex);
+    ret = usbserial_common_open_read_event(port);
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    return ret;
+}
+
+int usbserial_get_pollfds(
+        libusb_context* ctx,
+        struct usbserial_pollfd* pollfds,
+        unsigned int max_count,
+        int* out_timeout_millis)
+{
+    const struct libusb_pollfd** libusb_pollfds;
+    struct timeval tv;
+    unsigned int count;
+    int ret;
+
+    if ((!pollfds) && (max_count > 0)) return USBSERIAL_ERROR_INVALID_PARAMETER;
+
+    if (out_timeout_millis)
+    {
+        ret = libusb_get_next_timeout(ctx, &tv);
+        if (ret < 0) return ret;
+
+        if (0 == ret) *out_timeout_millis = -1;
+        else *out_timeout_millis = (int) (tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000);
+    }
+
+    libusb_pollfds = libusb_get_pollfds(ctx);
+    if (!libusb_pollfds) return USBSERIAL_ERROR_UNSUPPORTED_OPERATION;
+
+    for (count = 0; libusb_pollfds[count]; ++count)
+    {
+        if (count < max_count)
+        {
+            pollfds[count].fd = libusb_pollfds[count]->fd;
+            pollfds[count].events = libusb_pollfds[count]->events;
+        }
+    }
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000104)
+    libusb_free_pollfds(libusb_pollfds);
+#else
+    free((void*) libusb_pollfds);
+#endif
+
+    return (int) count;
+}
+
+int usbserial_handle_events_nonblocking(libusb_context* ctx)
+{
+    struct timeval tv = { 0, 0 };
+
+    return libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+}
+
+int usbserial_bytes_available(struct usbserial_port* port)
+{
+    if (!port) return USBSERIAL_ERROR_INVALID_PARAMETER;
+    if (!port->read_ring.data) return USBSERIAL_ERROR_ILLEGAL_STATE;
+
+    return (int) usbserial_ring_buffer_used(&port->read_ring);
+}
+
 int usbserial_write(
         struct usbserial_port* port,
         const void* data,
@@ -299,7 +1029,308 @@ int usbserial_write(
 {
     if (!port) return USBSERIAL_ERROR_INVALID_PARAMETER;
 
-    return port->driver->write(port, data, bytes_count);
+    return usbserial_write_timeout(
+                port,
+                data,
+                bytes_count,
+                atomic_load(&port->write_timeout_millis),
+                NULL);
+}
+
+int usbserial_write_timeout(
+        struct usbserial_port* port,
+        const void* data,
+        unsigned int bytes_count,
+        unsigned int timeout_millis,
+        unsigned int* out_bytes_written)
+{
+    return usbserial_write_priority(
+                port,
+                data,
+                bytes_count,
+                USBSERIAL_WRITE_PRIORITY_NORMAL,
+                timeout_millis,
+                out_bytes_written);
+}
+
+static uint64_t usbserial_enter_write_lane(
+        struct usbserial_port* port,
+        enum usbserial_write_priority priority)
+{
+    struct usbserial_write_lane_stats* stats = &port->write_lane_stats[priority];
+
+    usbserial_common_mutex_lock(&port->mutex);
+    ++stats->queue_depth;
+    if (stats->queue_depth > stats->max_queue_depth)
+    {
+        stats->max_queue_depth = stats->queue_depth;
+    }
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    return usbserial_common_get_time_micros();
+}
+
+static void usbserial_leave_write_lane(
+        struct usbserial_port* port,
+        enum usbserial_write_priority priority,
+        uint64_t start_micros,
+        unsigned int bytes_written)
+{
+    struct usbserial_write_lane_stats* stats = &port->write_lane_stats[priority];
+    uint64_t latency_micros = usbserial_common_get_time_micros() - start_micros;
+
+    usbserial_common_mutex_lock(&port->mutex);
+    --stats->queue_depth;
+    ++stats->writes;
+    stats->bytes_written += bytes_written;
+    stats->total_latency_micros += latency_micros;
+    if (latency_micros > stats->max_latency_micros)
+    {
+        stats->max_latency_micros = latency_micros;
+    }
+    usbserial_common_mutex_unlock(&port->mutex);
+}
+
+int usbserial_write_priority(
+        struct usbserial_port* port,
+        const void* data,
+        unsigned int bytes_count,
+        enum usbserial_write_priority priority,
+        unsigned int timeout_millis,
+        unsigned int* out_bytes_written)
+{
+    uint64_t deadline, start_micros;
+    unsigned int remaining_millis;
+    unsigned int bytes_written = 0;
+    int ret;
+
+    if (out_bytes_written) *out_bytes_written = 0;
+    if ((!port) || ((!data) && (bytes_count > 0))) return USBSERIAL_ERROR_INVALID_PARAMETER;
+    if ((priority < 0) || (priority >= USBSERIAL_WRITE_PRIORITIES_COUNT))
+    {
+        return USBSERIAL_ERROR_INVALID_PARAMETER;
+    }
+
+    start_micros = usbserial_enter_write_lane(port, priority);
+
+    ret = usbserial_writer_stage(port, data, bytes_count);
+    if (ret > 0)
+    {
+        bytes_written = bytes_count;
+        ret = 0;
+        goto leave_and_return;
+    }
+    if (0 != ret) goto leave_and_return;
+
+    deadline = usbserial_common_get_deadline_micros(timeout_millis);
+
+    ret = usbserial_writer_flush(port, timeout_millis);
+    if (0 == ret) ret = usbserial_common_get_remaining_millis(deadline, &remaining_millis);
+    if (0 == ret)
+    {
+        ret = usbserial_writer_write(
+                    port,
+                    data,
+                    bytes_count,
+                    priority,
+                    remaining_millis,
+                    &bytes_written);
+    }
+
+leave_and_return:
+    usbserial_leave_write_lane(port, priority, start_micros, bytes_written);
+    if (out_bytes_written) *out_bytes_written = bytes_written;
+    return ret;
+}
+
+int usbserial_port_get_write_lane_stats(
+        struct usbserial_port* port,
+        enum usbserial_write_priority priority,
+        struct usbserial_write_lane_stats* stats,
+        int reset)
+{
+    struct usbserial_write_lane_stats* lane_stats;
+
+    if ((!port) || (!stats)) return USBSERIAL_ERROR_INVALID_PARAMETER;
+    if ((priority < 0) || (priority >= USBSERIAL_WRITE_PRIORITIES_COUNT))
+    {
+        return USBSERIAL_ERROR_INVALID_PARAMETER;
+    }
+
+    lane_stats = &port->write_lane_stats[priority];
+
+    usbserial_common_mutex_lock(&port->mutex);
+    *stats = *lane_stats;
+    if (reset)
+    {
+        unsigned int queue_depth = lane_stats->queue_depth;
+        memset(lane_stats, 0, sizeof(*lane_stats));
+        lane_stats->queue_depth = queue_depth;
+        lane_stats->max_queue_depth = queue_depth;
+    }
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    return 0;
+}
+
+int usbserial_port_set_write_pacing(
+        struct usbserial_port* port,
+        unsigned int burst_bytes)
+{
+    if (!port) return USBSERIAL_ERROR_INVALID_PARAMETER;
+
+    usbserial_common_mutex_lock(&port->mutex);
+    port->write_pacing_burst = burst_bytes;
+    usbserial_writer_update_pacing(port);
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    return 0;
+}
+
+int usbserial_port_set_write_timeout(
+        struct usbserial_port* port,
+        unsigned int timeout_millis)
+{
+    if (!port) return USBSERIAL_ERROR_INVALID_PARAMETER;
+
+    atomic_store(&port->write_timeout_millis, timeout_millis);
+
+    return 0;
+}
+
+int usbserial_writev(
+        struct usbserial_port* port,
+        const struct iovec* iov,
+        unsigned int iov_count)
+{
+    size_t bytes_count = 0;
+    unsigned int timeout_millis;
+    uint64_t deadline, start_micros;
+    unsigned int remaining_millis;
+    unsigned int i;
+    int ret;
+
+    if ((!port) || ((!iov) && (iov_count > 0))) return USBSERIAL_ERROR_INVALID_PARAMETER;
+
+    for (i = 0; i < iov_count; ++i)
+    {
+        if ((!iov[i].iov_base) && (iov[i].iov_len > 0)) return USBSERIAL_ERROR_INVALID_PARAMETER;
+        bytes_count += iov[i].iov_len;
+        if (bytes_count > UINT_MAX) return USBSERIAL_ERROR_INVALID_PARAMETER;
+    }
+
+    start_micros = usbserial_enter_write_lane(port, USBSERIAL_WRITE_PRIORITY_NORMAL);
+
+    ret = usbserial_writer_stagev(port, iov, iov_count, (unsigned int) bytes_count);
+    if (0 != ret)
+    {
+        if (ret > 0) ret = 0;
+        goto leave_and_return;
+    }
+
+    timeout_millis = atomic_load(&port->write_timeout_millis);
+    deadline = usbserial_common_get_deadline_micros(timeout_millis);
+
+    ret = usbserial_writer_flush(port, timeout_millis);
+    if (0 == ret) ret = usbserial_common_get_remaining_millis(deadline, &remaining_millis);
+    if (0 == ret) ret = usbserial_writer_writev(port, iov, iov_count, remaining_millis);
+
+leave_and_return:
+    usbserial_leave_write_lane(
+                port,
+                USBSERIAL_WRITE_PRIORITY_NORMAL,
+                start_micros,
+                (0 == ret) ? (unsigned int) bytes_count : 0);
+    return ret;
+}
+
+int usbserial_flush(struct usbserial_port* port)
+{
+    if (!port) return USBSERIAL_ERROR_INVALID_PARAMETER;
+
+    return usbserial_writer_flush(port, atomic_load(&port->write_timeout_millis));
+}
+
+int usbserial_port_set_write_coalescing(
+        struct usbserial_port* port,
+        unsigned int min_bytes,
+        unsigned int max_delay_micros)
+{
+    if (!port) return USBSERIAL_ERROR_INVALID_PARAMETER;
+
+    return usbserial_writer_set_coalescing(port, min_bytes, max_delay_micros);
+}
+
+int usbserial_port_set_write_queue_depth(
+        struct usbserial_port* port,
+        unsigned int depth)
+{
+    int ret = 0;
+
+    if ((!port) || (0 == depth)) return USBSERIAL_ERROR_INVALID_PARAMETER;
+
+    usbserial_common_mutex_lock(&port->mutex);
+    if (port->write_transfers_pending > 0) ret = USBSERIAL_ERROR_ILLEGAL_STATE;
+    else port->write_queue_depth = depth;
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    return ret;
+}
+
+int usbserial_write_async(
+        struct usbserial_port* port,
+        const void* data,
+        unsigned int bytes_count,
+        usbserial_write_cb_fn write_cb,
+        void* user_data)
+{
+    if ((!port) || ((!data) && (bytes_count > 0))) return USBSERIAL_ERROR_INVALID_PARAMETER;
+
+    return usbserial_writer_submit(port, data, bytes_count, write_cb, user_data);
+}
+
+int usbserial_set_dtr_rts(
+        struct usbserial_port* port,
+        int dtr,
+        int rts)
+{
+    if (!port) return USBSERIAL_ERROR_INVALID_PARAMETER;
+
+    return port->driver->set_dtr_rts(port, dtr ? 1 : 0, rts ? 1 : 0);
+}
+
+int usbserial_get_modem_status(
+        struct usbserial_port* port,
+        unsigned int* out_modem_status)
+{
+    int modem_status;
+
+    if ((!port) || (!out_modem_status)) return USBSERIAL_ERROR_INVALID_PARAMETER;
+
+    modem_status = atomic_load(&port->modem_status);
+    if (modem_status >= 0)
+    {
+        *out_modem_status = (unsigned int) modem_status;
+        return 0;
+    }
+
+    return port->driver->get_modem_status(port, out_modem_status);
+}
+
+int usbserial_port_set_modem_status_cb(
+        struct usbserial_port* port,
+        usbserial_modem_status_cb_fn modem_status_cb)
+{
+    int ret = 0;
+
+    if (!port) return USBSERIAL_ERROR_INVALID_PARAMETER;
+
+    usbserial_common_mutex_lock(&port->mutex);
+    if (port->read_transfers) ret = USBSERIAL_ERROR_ILLEGAL_STATE;
+    else port->modem_status_cb = modem_status_cb;
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    return ret;
 }
 
 int usbserial_purge(
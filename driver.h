@@ -43,18 +43,38 @@ struct usbserial_driver
             struct usbserial_port* port,
             const struct usbserial_line_config* line_config);
 
+    int (*port_set_flow_control)(
+            struct usbserial_port* port,
+            enum usbserial_flow_control flow_control);
+
+    /* NULL if the driver has no options. */
+    int (*port_set_option)(
+            struct usbserial_port* port,
+            enum usbserial_port_option option,
+            int value);
+
     int (*start_reader)(struct usbserial_port* port);
     int (*stop_reader)(struct usbserial_port* port);
 
     int (*write)(
             struct usbserial_port* port,
             const void* data,
-            unsigned int bytes_count);
+            unsigned int bytes_count,
+            unsigned int timeout_millis,
+            unsigned int* out_bytes_written);
     int (*purge)(
             struct usbserial_port* port,
             int purge_rx,
             int purge_tx);
 
+    int (*set_dtr_rts)(
+            struct usbserial_port* port,
+            int dtr,
+            int rts);
+    int (*get_modem_status)(
+            struct usbserial_port* port,
+            unsigned int* out_modem_status);
+
     void (*read_data_postprocessor)(
             struct usbserial_port* port,
             void* data,
@@ -35,6 +35,10 @@ along with libusbserial. If not, see <http://www.gnu.org/licenses/>.
 #define CDC_ACM_REQTYPE LIBUSB_RECIPIENT_INTERFACE | 0x20
 
 #define CDC_SET_LINE_CODING_REQUEST_CODE 0x20
+#define CDC_SET_CONTROL_LINE_STATE_REQUEST_CODE 0x22
+
+#define CDC_CONTROL_LINE_STATE_DTR 0x0001
+#define CDC_CONTROL_LINE_STATE_RTS 0x0002
 
 #define PROLIFIC_VENDOR_OUT_REQTYPE 0x40
 
@@ -43,13 +47,16 @@ along with libusbserial. If not, see <http://www.gnu.org/licenses/>.
 #define PROLIFIC_FLUSH_RX_VALUE 0x08
 #define PROLIFIC_FLUSH_TX_VALUE 0x09
 
+#define PROLIFIC_FLOW_CONTROL_VALUE 0x00
+#define PROLIFIC_FLOW_CONTROL_RTS_CTS_INDEX 0x61
+#define PROLIFIC_FLOW_CONTROL_NONE_INDEX 0x00
+
 static const char* PROLIFIC_DEVICE_NAME_PL2303 = "PL2303";
 static const char* CDC_DEVICE_NAME_ARDUINO = "Arduino";
 static const char* CDC_DEVICE_NAME_CDC_ACM = "CDC";
 
 struct cdc_port_data
 {
-    struct libusb_transfer* transfer;
     uint8_t read_ep;
     uint8_t write_ep;
     int read_ep_if;
@@ -211,13 +218,13 @@ static int cdc_port_init(struct usbserial_port* port)
         ret = USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
         goto relase_if_and_return;
     }
-    port_data->transfer = NULL;
     port_data->read_ep = read_ep;
     port_data->write_ep = write_ep;
     port_data->read_ep_if = read_ep_if;
     port_data->write_ep_if = write_ep_if;
 
     port->driver_specific_data = port_data;
+    port->write_endpoint = write_ep;
 
     return 0;
 
@@ -333,63 +340,71 @@ static int cdc_port_set_line_config(
     else return ctrl_ret;
 }
 
-static int cdc_start_reader(struct usbserial_port* port)
+static int cdc_port_set_flow_control(
+        struct usbserial_port* port,
+        enum usbserial_flow_control flow_control)
 {
-    struct libusb_transfer* transfer;
-    struct cdc_port_data* port_data;
-    int submit_ret;
-
     assert(port);
-    assert(port->read_cb);
 
     if (!port->driver_specific_data) return USBSERIAL_ERROR_ILLEGAL_STATE;
 
-    port_data = (struct cdc_port_data*) port->driver_specific_data;
-    if (port_data->transfer) return USBSERIAL_ERROR_ILLEGAL_STATE;
-
-    transfer = libusb_alloc_transfer(0);
-    if (!transfer) return USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
-
-    usbserial_common_init_bulk_read_transfer(
-                transfer,
-                port_data->read_ep,
-                port);
-    submit_ret = libusb_submit_transfer(transfer);
-    if (0 != submit_ret)
+    if (PROLIFIC_VENDOR_ID == port->usb_device_descriptor.idVendor)
     {
-        libusb_free_transfer(transfer);
-        return submit_ret;
+        switch (flow_control)
+        {
+        case USBSERIAL_FLOW_CONTROL_NONE:
+            return prolific_vendor_out(
+                        port,
+                        PROLIFIC_FLOW_CONTROL_VALUE,
+                        PROLIFIC_FLOW_CONTROL_NONE_INDEX,
+                        NULL,
+                        0);
+        case USBSERIAL_FLOW_CONTROL_RTS_CTS:
+            return prolific_vendor_out(
+                        port,
+                        PROLIFIC_FLOW_CONTROL_VALUE,
+                        PROLIFIC_FLOW_CONTROL_RTS_CTS_INDEX,
+                        NULL,
+                        0);
+
+        default:
+            return USBSERIAL_ERROR_UNSUPPORTED_OPERATION;
+        }
     }
 
-    port_data->transfer = transfer;
-
-    return 0;
+    /* CDC ACM has no request for flow control. */
+    if (USBSERIAL_FLOW_CONTROL_NONE == flow_control) return 0;
+    return USBSERIAL_ERROR_UNSUPPORTED_OPERATION;
 }
 
-static int cdc_stop_reader(struct usbserial_port* port)
+static int cdc_start_reader(struct usbserial_port* port)
 {
+    struct cdc_port_data* port_data;
+
     assert(port);
 
-    struct cdc_port_data* port_data;
-    int ret;
+    if (!port->driver_specific_data) return USBSERIAL_ERROR_ILLEGAL_STATE;
 
     port_data = (struct cdc_port_data*) port->driver_specific_data;
-    if ((!port_data) || (!port_data->transfer))
-    {
-        return USBSERIAL_ERROR_ILLEGAL_STATE;
-    }
-    ret = usbserial_common_cancel_read_transfer_sync(port, port_data->transfer);
 
-    libusb_free_transfer(port_data->transfer);
-    port_data->transfer = NULL;
+    return usbserial_common_start_reader(port, port_data->read_ep);
+}
 
-    return ret;
+static int cdc_stop_reader(struct usbserial_port* port)
+{
+    assert(port);
+
+    if (!port->driver_specific_data) return USBSERIAL_ERROR_ILLEGAL_STATE;
+
+    return usbserial_common_stop_reader(port);
 }
 
 static int cdc_write(
         struct usbserial_port* port,
         const void* data,
-        unsigned int bytes_count)
+        unsigned int bytes_count,
+        unsigned int timeout_millis,
+        unsigned int* out_bytes_written)
 {
     assert(port);
 
@@ -399,10 +414,12 @@ static int cdc_write(
     if (!port_data) return USBSERIAL_ERROR_ILLEGAL_STATE;
 
     return usbserial_common_bulk_write(
-                port->usb_device_handle,
+                port,
                 port_data->write_ep,
                 data,
-                bytes_count);
+                bytes_count,
+                timeout_millis,
+                out_bytes_written);
 }
 
 static int cdc_purge(
@@ -428,6 +445,39 @@ static int cdc_purge(
     else return USBSERIAL_ERROR_UNSUPPORTED_OPERATION;
 }
 
+static int cdc_set_dtr_rts(
+        struct usbserial_port* port,
+        int dtr,
+        int rts)
+{
+    assert(port);
+
+    if (!port->driver_specific_data) return USBSERIAL_ERROR_ILLEGAL_STATE;
+
+    return libusb_control_transfer(
+                port->usb_device_handle,
+                CDC_ACM_REQTYPE,
+                CDC_SET_CONTROL_LINE_STATE_REQUEST_CODE,
+                (dtr ? CDC_CONTROL_LINE_STATE_DTR : 0)
+                    | (rts ? CDC_CONTROL_LINE_STATE_RTS : 0),
+                0,
+                NULL,
+                0,
+                DEFAULT_CONTROL_TIMEOUT_MILLIS);
+}
+
+static int cdc_get_modem_status(
+        struct usbserial_port* port,
+        unsigned int* out_modem_status)
+{
+    USBSERIAL_UNUSED_VAR(port);
+    USBSERIAL_UNUSED_VAR(out_modem_status);
+
+    /* Reported by SERIAL_STATE notifications on the interrupt
+     * endpoint, which is not read. */
+    return USBSERIAL_ERROR_UNSUPPORTED_OPERATION;
+}
+
 void cdc_driver_init(struct usbserial_driver* driver)
 {
     driver->check_supported_by_vid_pid = cdc_check_supported_by_vid_pid;
@@ -437,9 +487,13 @@ void cdc_driver_init(struct usbserial_driver* driver)
     driver->port_init = cdc_port_init;
     driver->port_deinit = cdc_port_deinit;
     driver->port_set_line_config = cdc_port_set_line_config;
+    driver->port_set_flow_control = cdc_port_set_flow_control;
+    driver->port_set_option = NULL;
     driver->start_reader = cdc_start_reader;
     driver->stop_reader = cdc_stop_reader;
     driver->write = cdc_write;
     driver->purge = cdc_purge;
+    driver->set_dtr_rts = cdc_set_dtr_rts;
+    driver->get_modem_status = cdc_get_modem_status;
     driver->read_data_postprocessor = NULL;
 }
@@ -16,11 +16,14 @@ along with libusbserial. If not, see <http://www.gnu.org/licenses/>.
 
 /* This file contains the implementation of a driver for FTDI devices. */
 
+#include "driver_ftdi.h"
+
 #include "common.h"
 #include "driver.h"
 
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define FTDI_VENDOR_ID 0x0403
 
@@ -30,8 +33,13 @@ along with libusbserial. If not, see <http://www.gnu.org/licenses/>.
 #define FTDI_PRODUCT_ID_FT231X 0x6015
 
 #define FTDI_SIO_REQUEST_RESET 0
+#define FTDI_SIO_REQUEST_SET_MODEM_CTRL 1
+#define FTDI_SIO_REQUEST_SET_FLOW_CTRL 2
 #define FTDI_SIO_REQUEST_SET_BAUD_RATE 3
 #define FTDI_SIO_REQUEST_SET_LINE_CONFIG 4
+#define FTDI_SIO_REQUEST_GET_MODEM_STATUS 5
+#define FTDI_SIO_REQUEST_SET_EVENT_CHAR 6
+#define FTDI_SIO_REQUEST_SET_LATENCY_TIMER 9
 
 #define FTDI_SIO_RESET 0
 #define FTDI_SIO_RESET_PURGE_RX 1
@@ -40,7 +48,39 @@ along with libusbserial. If not, see <http://www.gnu.org/licenses/>.
 #define FTDI_DEVICE_IN_REQTYPE LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | 0x80
 #define FTDI_DEVICE_OUT_REQTYPE LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE
 
-#define FTDI_MODEM_STATUS_BYTES_COUNT 2
+
+#define FTDI_SIO_SET_DTR_MASK 0x0100
+#define FTDI_SIO_SET_RTS_MASK 0x0200
+#define FTDI_SIO_SET_DTR_HIGH 0x0001
+#define FTDI_SIO_SET_RTS_HIGH 0x0002
+
+#define FTDI_SIO_DISABLE_FLOW_CTRL 0x00
+#define FTDI_SIO_RTS_CTS_HS 0x01
+#define FTDI_SIO_DTR_DSR_HS 0x02
+#define FTDI_SIO_XON_XOFF_HS 0x04
+
+#define FTDI_SIO_EVENT_CHAR_ENABLE 0x0100
+
+#define FTDI_MIN_LATENCY_TIMER_MILLIS 1
+#define FTDI_MAX_LATENCY_TIMER_MILLIS 255
+
+/* The adaptive latency timer is set to the low value only while some,
+ * but less than FTDI_ADAPTIVE_LATENCY_STREAMING_PACKETS packets full
+ * of data were received in the last window. An idle port keeps the high
+ * value, so its status packets do not wake up the host every 1 ms. */
+#define FTDI_ADAPTIVE_LATENCY_LOW_MILLIS 1
+#define FTDI_ADAPTIVE_LATENCY_HIGH_MILLIS 16
+#define FTDI_ADAPTIVE_LATENCY_WINDOW_MILLIS 50
+#define FTDI_ADAPTIVE_LATENCY_STREAMING_PACKETS 8
+
+#define FTDI_MODEM_STATUS_CTS 0x10
+#define FTDI_MODEM_STATUS_DSR 0x20
+#define FTDI_MODEM_STATUS_RI 0x40
+#define FTDI_MODEM_STATUS_DCD 0x80
+
+/* Full speed bulk packet size, used if the endpoint descriptor
+ * can't be read. */
+#define FTDI_DEFAULT_MAX_PACKET_SIZE 64
 
 #define FTDI_PARITY_LINE_CONFIG_VALUE_SHIFT 8
 #define FTDI_STOP_BITS_LINE_CONFIG_VALUE_SHIFT 11
@@ -78,9 +118,20 @@ struct ftdi_baud_data
 
 struct ftdi_port_data
 {
-    struct libusb_transfer* transfer;
     enum ftdi_device_type device_type;
     uint16_t control_idx;
+    unsigned int max_packet_size;
+    /* Adaptive latency timer, see USBSERIAL_PORT_OPTION_LATENCY_TIMER.
+     * Protected by port->mutex. latency_timer is the value last
+     * submitted, zero if unknown. The reader sets it with
+     * latency_transfer, cancel_cond is signalled when it completed. */
+    int latency_adaptive;
+    unsigned int latency_timer;
+    uint64_t latency_window_start_micros;
+    unsigned int latency_window_bytes;
+    struct libusb_transfer* latency_transfer;
+    int latency_transfer_submitted;
+    unsigned char latency_setup[LIBUSB_CONTROL_SETUP_SIZE];
 };
 
 static struct ftdi_baud_data convert_baudrate(
@@ -203,6 +254,14 @@ static int ftdi_reset_ctrl(
                 DEFAULT_CONTROL_TIMEOUT_MILLIS);
 }
 
+static unsigned int ftdi_convert_modem_status(uint8_t status_byte)
+{
+    return ((status_byte & FTDI_MODEM_STATUS_CTS) ? USBSERIAL_MODEM_STATUS_CTS : 0)
+            | ((status_byte & FTDI_MODEM_STATUS_DSR) ? USBSERIAL_MODEM_STATUS_DSR : 0)
+            | ((status_byte & FTDI_MODEM_STATUS_RI) ? USBSERIAL_MODEM_STATUS_RI : 0)
+            | ((status_byte & FTDI_MODEM_STATUS_DCD) ? USBSERIAL_MODEM_STATUS_DCD : 0);
+}
+
 static int ftdi_check_supported_by_vid_pid(
         uint16_t vendor_id,
         uint16_t product_id)
@@ -276,6 +335,7 @@ static int ftdi_port_init(struct usbserial_port* port)
     int ret;
     enum ftdi_device_type device_type;
     uint16_t control_idx;
+    int max_packet_size;
 
     assert(port);
 
@@ -296,6 +356,17 @@ static int ftdi_port_init(struct usbserial_port* port)
         control_idx = 0;
     }
 
+    /* The modem status bytes are sent at the start of each packet
+     * of the bulk IN endpoint, which has 64 bytes packets for full
+     * speed and 512 bytes packets for high speed devices. */
+    max_packet_size = libusb_get_max_packet_size(
+                port->usb_device,
+                FTDI_READ_ENDPOINT(port->port_idx));
+    if (max_packet_size <= FTDI_MODEM_STATUS_BYTES_COUNT)
+    {
+        max_packet_size = FTDI_DEFAULT_MAX_PACKET_SIZE;
+    }
+
     ret = libusb_claim_interface(port->usb_device_handle, port->port_idx);
     if (0 != ret) return ret;
 
@@ -308,11 +379,24 @@ static int ftdi_port_init(struct usbserial_port* port)
         ret = USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
         goto relase_if_and_return;
     }
-    port_data->transfer = NULL;
+    port_data->latency_transfer = libusb_alloc_transfer(0);
+    if (!port_data->latency_transfer)
+    {
+        free(port_data);
+        ret = USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
+        goto relase_if_and_return;
+    }
     port_data->device_type = device_type;
     port_data->control_idx = control_idx;
+    port_data->max_packet_size = (unsigned int) max_packet_size;
+    port_data->latency_adaptive = 0;
+    port_data->latency_timer = 0;
+    port_data->latency_window_start_micros = 0;
+    port_data->latency_window_bytes = 0;
+    port_data->latency_transfer_submitted = 0;
 
     port->driver_specific_data = port_data;
+    port->write_endpoint = FTDI_WRITE_ENDPOINT(port->port_idx);
 
     return 0;
 
@@ -322,12 +406,27 @@ relase_if_and_return:
     return ret;
 }
 
+/* Wait until the adaptive latency timer is not being set. */
+static void ftdi_wait_latency_transfer(struct usbserial_port* port)
+{
+    struct ftdi_port_data* port_data = (struct ftdi_port_data*) port->driver_specific_data;
+
+    usbserial_common_mutex_lock(&port->mutex);
+    while (port_data->latency_transfer_submitted)
+    {
+        usbserial_common_cond_wait(&port->cancel_cond, &port->mutex);
+    }
+    usbserial_common_mutex_unlock(&port->mutex);
+}
+
 static int ftdi_port_deinit(struct usbserial_port* port)
 {
     assert(port);
 
     if (!port->driver_specific_data) return USBSERIAL_ERROR_ILLEGAL_STATE;
 
+    ftdi_wait_latency_transfer(port);
+    libusb_free_transfer(((struct ftdi_port_data*) port->driver_specific_data)->latency_transfer);
     free(port->driver_specific_data);
     port->driver_specific_data = NULL;
 
@@ -425,55 +524,223 @@ static int ftdi_port_set_line_config(
     return ret;
 }
 
-static int ftdi_start_reader(struct usbserial_port* port)
+static int ftdi_port_set_flow_control(
+        struct usbserial_port* port,
+        enum usbserial_flow_control flow_control)
 {
-    struct libusb_transfer* transfer;
     struct ftdi_port_data* port_data;
-    int submit_ret;
+    uint16_t handshake, value = 0;
 
     assert(port);
-    assert(port->read_cb);
 
     if (!port->driver_specific_data) return USBSERIAL_ERROR_ILLEGAL_STATE;
 
     port_data = (struct ftdi_port_data*) port->driver_specific_data;
-    if (port_data->transfer) return USBSERIAL_ERROR_ILLEGAL_STATE;
-
-    transfer = libusb_alloc_transfer(0);
-    if (!transfer) return USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
 
-    usbserial_common_init_bulk_read_transfer(
-                transfer,
-                FTDI_READ_ENDPOINT(port->port_idx),
-                port);
-    submit_ret = libusb_submit_transfer(transfer);
-    if (0 != submit_ret)
+    switch (flow_control)
     {
-        libusb_free_transfer(transfer);
-        return submit_ret;
-    }
+    case USBSERIAL_FLOW_CONTROL_NONE:
+        handshake = FTDI_SIO_DISABLE_FLOW_CTRL;
+        break;
+    case USBSERIAL_FLOW_CONTROL_RTS_CTS:
+        handshake = FTDI_SIO_RTS_CTS_HS;
+        break;
+    case USBSERIAL_FLOW_CONTROL_DTR_DSR:
+        handshake = FTDI_SIO_DTR_DSR_HS;
+        break;
+    case USBSERIAL_FLOW_CONTROL_XON_XOFF:
+        handshake = FTDI_SIO_XON_XOFF_HS;
+        value = (USBSERIAL_XOFF << 8) | USBSERIAL_XON;
+        break;
 
-    port_data->transfer = transfer;
+    default:
+        return USBSERIAL_ERROR_INVALID_PARAMETER;
+    }
 
-    return 0;
+    /* The handshake is passed in the high byte of the index. */
+    return libusb_control_transfer(
+                port->usb_device_handle,
+                FTDI_DEVICE_OUT_REQTYPE,
+                FTDI_SIO_REQUEST_SET_FLOW_CTRL,
+                value,
+                (uint16_t) ((handshake << 8) | port_data->control_idx),
+                NULL,
+                0,
+                DEFAULT_CONTROL_TIMEOUT_MILLIS);
 }
 
-static int ftdi_stop_reader(struct usbserial_port* port)
+static int ftdi_port_set_option(
+        struct usbserial_port* port,
+        enum usbserial_port_option option,
+        int value)
 {
-    assert(port);
-
     struct ftdi_port_data* port_data;
+    uint16_t request, request_value;
     int ret;
 
+    assert(port);
+
+    if (!port->driver_specific_data) return USBSERIAL_ERROR_ILLEGAL_STATE;
+
     port_data = (struct ftdi_port_data*) port->driver_specific_data;
-    if ((!port_data) || (!port_data->transfer))
+
+    switch (option)
+    {
+    case USBSERIAL_PORT_OPTION_LATENCY_TIMER:
+        if (value > FTDI_MAX_LATENCY_TIMER_MILLIS) return USBSERIAL_ERROR_INVALID_PARAMETER;
+        if (value < 0)
+        {
+            /* Set by the reader from now on. */
+            usbserial_common_mutex_lock(&port->mutex);
+            port_data->latency_adaptive = 1;
+            port_data->latency_window_start_micros = usbserial_common_get_time_micros();
+            port_data->latency_window_bytes = 0;
+            usbserial_common_mutex_unlock(&port->mutex);
+            return 0;
+        }
+        if (value < FTDI_MIN_LATENCY_TIMER_MILLIS) return USBSERIAL_ERROR_INVALID_PARAMETER;
+        request = FTDI_SIO_REQUEST_SET_LATENCY_TIMER;
+        request_value = (uint16_t) value;
+        break;
+
+    case USBSERIAL_PORT_OPTION_EVENT_CHAR:
+        if (value > 0xff) return USBSERIAL_ERROR_INVALID_PARAMETER;
+        request = FTDI_SIO_REQUEST_SET_EVENT_CHAR;
+        request_value = (value < 0) ? 0 : (uint16_t) (value | FTDI_SIO_EVENT_CHAR_ENABLE);
+        break;
+
+    default:
+        return USBSERIAL_ERROR_UNSUPPORTED_OPERATION;
+    }
+
+    if (FTDI_SIO_REQUEST_SET_LATENCY_TIMER == request)
     {
-        return USBSERIAL_ERROR_ILLEGAL_STATE;
+        /* Not to be overwritten by a timer set by the reader. */
+        usbserial_common_mutex_lock(&port->mutex);
+        port_data->latency_adaptive = 0;
+        usbserial_common_mutex_unlock(&port->mutex);
+        ftdi_wait_latency_transfer(port);
     }
-    ret = usbserial_common_cancel_read_transfer_sync(port, port_data->transfer);
 
-    libusb_free_transfer(port_data->transfer);
-    port_data->transfer = NULL;
+    ret = libusb_control_transfer(
+                port->usb_device_handle,
+                FTDI_DEVICE_OUT_REQTYPE,
+                (uint8_t) request,
+                request_value,
+                port_data->control_idx,
+                NULL,
+                0,
+                DEFAULT_CONTROL_TIMEOUT_MILLIS);
+
+    if (FTDI_SIO_REQUEST_SET_LATENCY_TIMER == request)
+    {
+        usbserial_common_mutex_lock(&port->mutex);
+        port_data->latency_timer = (0 == ret) ? request_value : 0;
+        usbserial_common_mutex_unlock(&port->mutex);
+    }
+
+    return ret;
+}
+
+static void ftdi_latency_transfer_callback(struct libusb_transfer* transfer)
+{
+    struct usbserial_port* port = (struct usbserial_port*) transfer->user_data;
+    struct ftdi_port_data* port_data = (struct ftdi_port_data*) port->driver_specific_data;
+
+    usbserial_common_mutex_lock(&port->mutex);
+    /* Set again by the next window, if it failed. */
+    if (LIBUSB_TRANSFER_COMPLETED != transfer->status) port_data->latency_timer = 0;
+    port_data->latency_transfer_submitted = 0;
+    usbserial_common_cond_broadcast(&port->cancel_cond);
+    usbserial_common_mutex_unlock(&port->mutex);
+}
+
+/* Must be called with port->mutex locked, by the reader. Counts
+ * payload_count bytes to the current window, and submits the latency
+ * timer for the traffic of the window when it is over. The timer is
+ * set asynchronously, as the reader runs on the event thread. */
+static void ftdi_adapt_latency_timer(
+        struct usbserial_port* port,
+        struct ftdi_port_data* port_data,
+        unsigned int payload_count)
+{
+    uint64_t now = usbserial_common_get_time_micros();
+    unsigned int streaming_bytes, latency_timer;
+
+    port_data->latency_window_bytes += payload_count;
+    if (now < port_data->latency_window_start_micros
+            + (uint64_t) FTDI_ADAPTIVE_LATENCY_WINDOW_MILLIS * 1000)
+    {
+        return;
+    }
+
+    streaming_bytes = FTDI_ADAPTIVE_LATENCY_STREAMING_PACKETS
+            * (port_data->max_packet_size - FTDI_MODEM_STATUS_BYTES_COUNT);
+    latency_timer = ((port_data->latency_window_bytes > 0)
+                     && (port_data->latency_window_bytes < streaming_bytes))
+            ? FTDI_ADAPTIVE_LATENCY_LOW_MILLIS : FTDI_ADAPTIVE_LATENCY_HIGH_MILLIS;
+
+    port_data->latency_window_start_micros = now;
+    port_data->latency_window_bytes = 0;
+
+    if ((latency_timer == port_data->latency_timer)
+            || port_data->latency_transfer_submitted)
+    {
+        return;
+    }
+
+    libusb_fill_control_setup(
+                port_data->latency_setup,
+                FTDI_DEVICE_OUT_REQTYPE,
+                FTDI_SIO_REQUEST_SET_LATENCY_TIMER,
+                (uint16_t) latency_timer,
+                port_data->control_idx,
+                0);
+    libusb_fill_control_transfer(
+                port_data->latency_transfer,
+                port->usb_device_handle,
+                port_data->latency_setup,
+                ftdi_latency_transfer_callback,
+                port,
+                DEFAULT_CONTROL_TIMEOUT_MILLIS);
+
+    if (0 == libusb_submit_transfer(port_data->latency_transfer))
+    {
+        port_data->latency_transfer_submitted = 1;
+        port_data->latency_timer = latency_timer;
+    }
+}
+
+static int ftdi_start_reader(struct usbserial_port* port)
+{
+    struct ftdi_port_data* port_data;
+
+    assert(port);
+
+    if (!port->driver_specific_data) return USBSERIAL_ERROR_ILLEGAL_STATE;
+
+    port_data = (struct ftdi_port_data*) port->driver_specific_data;
+
+    usbserial_common_mutex_lock(&port->mutex);
+    port_data->latency_window_start_micros = usbserial_common_get_time_micros();
+    port_data->latency_window_bytes = 0;
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    return usbserial_common_start_reader(
+                port,
+                FTDI_READ_ENDPOINT(port->port_idx));
+}
+
+static int ftdi_stop_reader(struct usbserial_port* port)
+{
+    int ret;
+
+    assert(port);
+
+    if (!port->driver_specific_data) return USBSERIAL_ERROR_ILLEGAL_STATE;
+
+    ret = usbserial_common_stop_reader(port);
+    ftdi_wait_latency_transfer(port);
 
     return ret;
 }
@@ -481,17 +748,21 @@ static int ftdi_stop_reader(struct usbserial_port* port)
 static int ftdi_write(
         struct usbserial_port* port,
         const void* data,
-        unsigned int bytes_count)
+        unsigned int bytes_count,
+        unsigned int timeout_millis,
+        unsigned int* out_bytes_written)
 {
     assert(port);
 
     if (!port->driver_specific_data) return USBSERIAL_ERROR_ILLEGAL_STATE;
 
     return usbserial_common_bulk_write(
-                port->usb_device_handle,
+                port,
                 FTDI_WRITE_ENDPOINT(port->port_idx),
                 data,
-                bytes_count);
+                bytes_count,
+                timeout_millis,
+                out_bytes_written);
 }
 
 static int ftdi_purge(
@@ -518,35 +789,128 @@ static int ftdi_purge(
     return (0 == purge_rx_ret) ? purge_tx_ret : purge_rx_ret;
 }
 
-static void ftdi_read_data_postprocessor(
+static int ftdi_set_dtr_rts(
         struct usbserial_port* port,
-        void* data,
-        unsigned int* bytes_count)
+        int dtr,
+        int rts)
 {
+    struct ftdi_port_data* port_data;
+    uint16_t value;
+
     assert(port);
+
+    if (!port->driver_specific_data) return USBSERIAL_ERROR_ILLEGAL_STATE;
+
+    port_data = (struct ftdi_port_data*) port->driver_specific_data;
+
+    value = FTDI_SIO_SET_DTR_MASK
+            | FTDI_SIO_SET_RTS_MASK
+            | (dtr ? FTDI_SIO_SET_DTR_HIGH : 0)
+            | (rts ? FTDI_SIO_SET_RTS_HIGH : 0);
+
+    return libusb_control_transfer(
+                port->usb_device_handle,
+                FTDI_DEVICE_OUT_REQTYPE,
+                FTDI_SIO_REQUEST_SET_MODEM_CTRL,
+                value,
+                port_data->control_idx,
+                NULL,
+                0,
+                DEFAULT_CONTROL_TIMEOUT_MILLIS);
+}
+
+static int ftdi_get_modem_status(
+        struct usbserial_port* port,
+        unsigned int* out_modem_status)
+{
+    struct ftdi_port_data* port_data;
+    unsigned char data[FTDI_MODEM_STATUS_BYTES_COUNT];
+    int ctrl_ret;
+
+    assert(port);
+
+    if (!port->driver_specific_data) return USBSERIAL_ERROR_ILLEGAL_STATE;
+
+    port_data = (struct ftdi_port_data*) port->driver_specific_data;
+
+    ctrl_ret = libusb_control_transfer(
+                port->usb_device_handle,
+                FTDI_DEVICE_IN_REQTYPE,
+                FTDI_SIO_REQUEST_GET_MODEM_STATUS,
+                0,
+                port_data->control_idx,
+                data,
+                sizeof(data),
+                DEFAULT_CONTROL_TIMEOUT_MILLIS);
+    if (ctrl_ret < 0) return ctrl_ret;
+    if (ctrl_ret < 1) return USBSERIAL_ERROR_CTRL_CMD_FAILED;
+
+    *out_modem_status = ftdi_convert_modem_status(data[0]);
+
+    return 0;
+}
+
+int ftdi_strip_modem_status(
+        void* data,
+        unsigned int* bytes_count,
+        unsigned int max_packet_size)
+{
     assert(data);
     assert(bytes_count);
+    assert(max_packet_size > FTDI_MODEM_STATUS_BYTES_COUNT);
 
-    int i;
-    int skip_bytes_count = FTDI_MODEM_STATUS_BYTES_COUNT;
-    const unsigned int unfiltered_bytes_count = *bytes_count;
-    char* data_as_chars = (char*) data;
-    const unsigned int max_packet_size = port->usb_device_descriptor.bMaxPacketSize0;
+    unsigned char* packet = (unsigned char*) data;
+    unsigned char* payload_end = (unsigned char*) data;
+    unsigned int remaining_count = *bytes_count;
+    int status_byte = -1;
 
-    for (i = FTDI_MODEM_STATUS_BYTES_COUNT; i < unfiltered_bytes_count; ++i)
+    /* Move the payload of each packet in one piece, directly
+     * behind the payload of the previous packet. */
+    while (remaining_count > 0)
     {
-        if (0 == (i % max_packet_size))
-        {
-            skip_bytes_count += FTDI_MODEM_STATUS_BYTES_COUNT;
-            ++i;
-        }
-        else
+        unsigned int packet_count = (remaining_count < max_packet_size)
+                ? remaining_count : max_packet_size;
+
+        /* The modem status of the last packet is the current one. */
+        if (packet_count >= FTDI_MODEM_STATUS_BYTES_COUNT) status_byte = packet[0];
+
+        if (packet_count > FTDI_MODEM_STATUS_BYTES_COUNT)
         {
-            data_as_chars[i - skip_bytes_count] = data_as_chars[i];
+            unsigned int payload_count = packet_count - FTDI_MODEM_STATUS_BYTES_COUNT;
+            memmove(payload_end, packet + FTDI_MODEM_STATUS_BYTES_COUNT, payload_count);
+            payload_end += payload_count;
         }
+
+        packet += packet_count;
+        remaining_count -= packet_count;
     }
 
-    *bytes_count -= skip_bytes_count;
+    *bytes_count = (unsigned int) (payload_end - (unsigned char*) data);
+
+    return status_byte;
+}
+
+static void ftdi_read_data_postprocessor(
+        struct usbserial_port* port,
+        void* data,
+        unsigned int* bytes_count)
+{
+    assert(port);
+    assert(data);
+    assert(bytes_count);
+    assert(port->driver_specific_data);
+
+    struct ftdi_port_data* port_data = (struct ftdi_port_data*) port->driver_specific_data;
+    int status_byte = ftdi_strip_modem_status(data, bytes_count, port_data->max_packet_size);
+
+    if (port_data->latency_adaptive) ftdi_adapt_latency_timer(port, port_data, *bytes_count);
+
+    if (status_byte >= 0)
+    {
+        usbserial_common_update_modem_status(
+                    port,
+                    ftdi_convert_modem_status((uint8_t) status_byte));
+    }
 }
 
 void ftdi_driver_init(struct usbserial_driver* driver)
@@ -558,9 +922,13 @@ void ftdi_driver_init(struct usbserial_driver* driver)
     driver->port_init = ftdi_port_init;
     driver->port_deinit = ftdi_port_deinit;
     driver->port_set_line_config = ftdi_port_set_line_config;
+    driver->port_set_flow_control = ftdi_port_set_flow_control;
+    driver->port_set_option = ftdi_port_set_option;
     driver->start_reader = ftdi_start_reader;
     driver->stop_reader = ftdi_stop_reader;
     driver->write = ftdi_write;
     driver->purge = ftdi_purge;
+    driver->set_dtr_rts = ftdi_set_dtr_rts;
+    driver->get_modem_status = ftdi_get_modem_status;
     driver->read_data_postprocessor = ftdi_read_data_postprocessor;
 }
@@ -0,0 +1,34 @@
+/*
+This file is part of libusbserial.
+
+libusbserial is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2 of the License.
+
+libusbserial is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libusbserial. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* This file contains the prototypes of the FTDI driver which are
+ * shared beyond driver_ftdi.c. */
+
+#ifndef LIBUSBSERIAL_DRIVER_FTDI_H
+#define LIBUSBSERIAL_DRIVER_FTDI_H
+
+#define FTDI_MODEM_STATUS_BYTES_COUNT 2
+
+/* Remove the FTDI_MODEM_STATUS_BYTES_COUNT modem status bytes heading
+ * each packet of max_packet_size bytes from the data of a bulk IN
+ * transfer, in place, *bytes_count is updated. Returns the first modem
+ * status byte of the last packet, or -1 if there is none. */
+int ftdi_strip_modem_status(
+        void* data,
+        unsigned int* bytes_count,
+        unsigned int max_packet_size);
+
+#endif // LIBUSBSERIAL_DRIVER_FTDI_H
@@ -31,13 +31,16 @@ along with libusbserial. If not, see <http://www.gnu.org/licenses/>.
 #define SILABS_PRODUCT_ID_CP2110 0xea80
 
 #define SILABS_HOST_TO_DEVICE_REQTYPE 0x41
+#define SILABS_DEVICE_TO_HOST_REQTYPE 0xc1
 
 #define SILABS_IFC_REQUEST_CODE 0x00
 #define SILABS_BAUDDIV_REQUEST_CODE 0x01
 #define SILABS_LINE_CTL_REQUEST_CODE 0x03
 #define SILABS_MHS_REQUEST_CODE 0x07
+#define SILABS_GET_MDMSTS_REQUEST_CODE 0x08
 #define SILABS_BAUDRATE_REQUEST_CODE 0x1e
 #define SILABS_FLUSH_REQUEST_CODE 0x12
+#define SILABS_SET_FLOW_REQUEST_CODE 0x13
 
 #define SILABS_IFC_UART_ENABLE_VALUE 0x0001
 #define SILABS_IFC_UART_DISABLE_VALUE 0x0000
@@ -47,6 +50,22 @@ along with libusbserial. If not, see <http://www.gnu.org/licenses/>.
 #define SILABS_MHS_CTRL_DTR_VALUE 0x0100
 #define SILABS_MHS_CTLR_RTS_VALUE 0x0200
 
+#define SILABS_MDMSTS_CTS 0x10
+#define SILABS_MDMSTS_DSR 0x20
+#define SILABS_MDMSTS_RI 0x40
+#define SILABS_MDMSTS_DCD 0x80
+
+/* ulControlHandshake and ulFlowReplace of SET_FLOW. */
+#define SILABS_FLOW_DTR_ACTIVE 0x00000001
+#define SILABS_FLOW_DTR_HANDSHAKE 0x00000002
+#define SILABS_FLOW_CTS_HANDSHAKE 0x00000008
+#define SILABS_FLOW_DSR_HANDSHAKE 0x00000010
+#define SILABS_FLOW_RTS_ACTIVE 0x00000040
+#define SILABS_FLOW_RTS_HANDSHAKE 0x00000080
+
+#define SILABS_FLOW_XON_LIMIT 128
+#define SILABS_FLOW_XOFF_LIMIT 128
+
 #define SILABS_FLUSH_RX_VALUE 0x0a
 #define SILABS_FLUSH_TX_VALUE 0x05
 
@@ -65,7 +84,12 @@ static const char* SILABS_DEVICE_NAME_CP21XX = "CP21XX";
 
 struct silabs_port_data
 {
-    struct libusb_transfer* transfer;
+    uint8_t read_ep;
+    uint8_t write_ep;
+    /* DTR and RTS as last set, SET_FLOW sets the lines which are not
+     * handed to the hardware handshake as well. */
+    int dtr;
+    int rts;
 };
 
 static int silabs_set_config(
@@ -171,7 +195,7 @@ static int silabs_port_init(struct usbserial_port* port)
 
     ret = silabs_set_config(
                 port,
-                SILABS_BAUDDIV_REQUEST_CODE,
+                SILABS_MHS_REQUEST_CODE,
                 SILABS_MHS_MCR_DTR_VALUE
                     | SILABS_MHS_MCR_RTS_VALUE
                     | SILABS_MHS_CTRL_DTR_VALUE
@@ -191,9 +215,13 @@ static int silabs_port_init(struct usbserial_port* port)
         ret = USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
         goto relase_if_and_return;
     }
-    port_data->transfer = NULL;
+    port_data->read_ep = SILABS_READ_ENDPOINT(port->port_idx);
+    port_data->write_ep = SILABS_WRITE_ENDPOINT(port->port_idx);
+    port_data->dtr = 1;
+    port_data->rts = 1;
 
     port->driver_specific_data = port_data;
+    port->write_endpoint = port_data->write_ep;
 
     return 0;
 
@@ -251,7 +279,7 @@ static int silabs_port_set_line_config(
         return USBSERIAL_ERROR_INVALID_PARAMETER;
     }
 
-    flow_control_byte = 0; /* Hardware flow control not supported (yet) */
+    flow_control_byte = 0; /* Flow control is set by silabs_port_set_flow_control() */
 
     data_bits_byte = (unsigned char) line_config->data_bits;
 
@@ -302,73 +330,106 @@ static int silabs_port_set_line_config(
     else return ctrl_ret;
 }
 
-static int silabs_start_reader(struct usbserial_port* port)
+static int silabs_port_set_flow_control(
+        struct usbserial_port* port,
+        enum usbserial_flow_control flow_control)
 {
-    struct libusb_transfer* transfer;
-    struct silabs_port_data* port_data;
-    int submit_ret;
-
     assert(port);
-    assert(port->read_cb);
 
-    if (!port->driver_specific_data) return USBSERIAL_ERROR_ILLEGAL_STATE;
+    struct silabs_port_data* port_data;
+    int ctrl_ret;
+    uint32_t control_handshake, flow_replace, dtr_active, rts_active, data_le[4];
 
+    if (!port->driver_specific_data) return USBSERIAL_ERROR_ILLEGAL_STATE;
     port_data = (struct silabs_port_data*) port->driver_specific_data;
-    if (port_data->transfer) return USBSERIAL_ERROR_ILLEGAL_STATE;
 
-    transfer = libusb_alloc_transfer(0);
-    if (!transfer) return USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
+    dtr_active = port_data->dtr ? SILABS_FLOW_DTR_ACTIVE : 0;
+    rts_active = port_data->rts ? SILABS_FLOW_RTS_ACTIVE : 0;
 
-    usbserial_common_init_bulk_read_transfer(
-                transfer,
-                SILABS_READ_ENDPOINT(port->port_idx),
-                port);
-    submit_ret = libusb_submit_transfer(transfer);
-    if (0 != submit_ret)
+    switch (flow_control)
     {
-        libusb_free_transfer(transfer);
-        return submit_ret;
+    case USBSERIAL_FLOW_CONTROL_NONE:
+        control_handshake = dtr_active;
+        flow_replace = rts_active;
+        break;
+    case USBSERIAL_FLOW_CONTROL_RTS_CTS:
+        control_handshake = dtr_active | SILABS_FLOW_CTS_HANDSHAKE;
+        flow_replace = SILABS_FLOW_RTS_HANDSHAKE;
+        break;
+    case USBSERIAL_FLOW_CONTROL_DTR_DSR:
+        control_handshake = SILABS_FLOW_DTR_HANDSHAKE | SILABS_FLOW_DSR_HANDSHAKE;
+        flow_replace = rts_active;
+        break;
+
+    default:
+        return USBSERIAL_ERROR_UNSUPPORTED_OPERATION;
     }
 
-    port_data->transfer = transfer;
+    data_le[0] = usbserial_common_convert_to_le(control_handshake);
+    data_le[1] = usbserial_common_convert_to_le(flow_replace);
+    data_le[2] = usbserial_common_convert_to_le((uint32_t) SILABS_FLOW_XON_LIMIT);
+    data_le[3] = usbserial_common_convert_to_le((uint32_t) SILABS_FLOW_XOFF_LIMIT);
 
-    return 0;
+    ctrl_ret = libusb_control_transfer(
+                port->usb_device_handle,
+                SILABS_HOST_TO_DEVICE_REQTYPE,
+                SILABS_SET_FLOW_REQUEST_CODE,
+                0,
+                (uint16_t) port->port_idx,
+                (unsigned char*) data_le,
+                sizeof(data_le),
+                DEFAULT_CONTROL_TIMEOUT_MILLIS);
+    if (ctrl_ret > 0)
+    {
+        if (ctrl_ret == sizeof(data_le)) return 0;
+        else return USBSERIAL_ERROR_CTRL_CMD_FAILED;
+    }
+    else return ctrl_ret;
 }
 
-static int silabs_stop_reader(struct usbserial_port* port)
+static int silabs_start_reader(struct usbserial_port* port)
 {
+    struct silabs_port_data* port_data;
+
     assert(port);
 
-    struct silabs_port_data* port_data;
-    int ret;
+    if (!port->driver_specific_data) return USBSERIAL_ERROR_ILLEGAL_STATE;
 
     port_data = (struct silabs_port_data*) port->driver_specific_data;
-    if ((!port_data) || (!port_data->transfer))
-    {
-        return USBSERIAL_ERROR_ILLEGAL_STATE;
-    }
-    ret = usbserial_common_cancel_read_transfer_sync(port, port_data->transfer);
 
-    libusb_free_transfer(port_data->transfer);
-    port_data->transfer = NULL;
+    return usbserial_common_start_reader(port, port_data->read_ep);
+}
 
-    return ret;
+static int silabs_stop_reader(struct usbserial_port* port)
+{
+    assert(port);
+
+    if (!port->driver_specific_data) return USBSERIAL_ERROR_ILLEGAL_STATE;
+
+    return usbserial_common_stop_reader(port);
 }
 
 static int silabs_write(
         struct usbserial_port* port,
         const void* data,
-        unsigned int bytes_count)
+        unsigned int bytes_count,
+        unsigned int timeout_millis,
+        unsigned int* out_bytes_written)
 {
     assert(port);
 
-    if (!port->driver_specific_data) return USBSERIAL_ERROR_ILLEGAL_STATE;
+    struct silabs_port_data* port_data;
+
+    port_data = (struct silabs_port_data*) port->driver_specific_data;
+    if (!port_data) return USBSERIAL_ERROR_ILLEGAL_STATE;
 
     return usbserial_common_bulk_write(
-                port->usb_device_handle,
-                SILABS_WRITE_ENDPOINT(port->port_idx),
+                port,
+                port_data->write_ep,
                 data,
-                bytes_count);
+                bytes_count,
+                timeout_millis,
+                out_bytes_written);
 }
 
 static int silabs_purge(
@@ -385,6 +446,65 @@ static int silabs_purge(
     return silabs_set_config(port, SILABS_FLUSH_REQUEST_CODE, value);
 }
 
+static int silabs_set_dtr_rts(
+        struct usbserial_port* port,
+        int dtr,
+        int rts)
+{
+    assert(port);
+
+    struct silabs_port_data* port_data;
+    int ret;
+
+    if (!port->driver_specific_data) return USBSERIAL_ERROR_ILLEGAL_STATE;
+    port_data = (struct silabs_port_data*) port->driver_specific_data;
+
+    ret = silabs_set_config(
+                port,
+                SILABS_MHS_REQUEST_CODE,
+                SILABS_MHS_CTRL_DTR_VALUE
+                    | SILABS_MHS_CTLR_RTS_VALUE
+                    | (dtr ? SILABS_MHS_MCR_DTR_VALUE : 0)
+                    | (rts ? SILABS_MHS_MCR_RTS_VALUE : 0));
+    if (0 != ret) return ret;
+
+    port_data->dtr = dtr;
+    port_data->rts = rts;
+
+    return 0;
+}
+
+static int silabs_get_modem_status(
+        struct usbserial_port* port,
+        unsigned int* out_modem_status)
+{
+    unsigned char status_byte;
+    int ctrl_ret;
+
+    assert(port);
+
+    if (!port->driver_specific_data) return USBSERIAL_ERROR_ILLEGAL_STATE;
+
+    ctrl_ret = libusb_control_transfer(
+                port->usb_device_handle,
+                SILABS_DEVICE_TO_HOST_REQTYPE,
+                SILABS_GET_MDMSTS_REQUEST_CODE,
+                0,
+                (uint16_t) port->port_idx,
+                &status_byte,
+                sizeof(status_byte),
+                DEFAULT_CONTROL_TIMEOUT_MILLIS);
+    if (ctrl_ret < 0) return ctrl_ret;
+    if (ctrl_ret != sizeof(status_byte)) return USBSERIAL_ERROR_CTRL_CMD_FAILED;
+
+    *out_modem_status = ((status_byte & SILABS_MDMSTS_CTS) ? USBSERIAL_MODEM_STATUS_CTS : 0)
+            | ((status_byte & SILABS_MDMSTS_DSR) ? USBSERIAL_MODEM_STATUS_DSR : 0)
+            | ((status_byte & SILABS_MDMSTS_RI) ? USBSERIAL_MODEM_STATUS_RI : 0)
+            | ((status_byte & SILABS_MDMSTS_DCD) ? USBSERIAL_MODEM_STATUS_DCD : 0);
+
+    return 0;
+}
+
 void silabs_driver_init(struct usbserial_driver* driver)
 {
     driver->check_supported_by_vid_pid = silabs_check_supported_by_vid_pid;
@@ -394,9 +514,13 @@ void silabs_driver_init(struct usbserial_driver* driver)
     driver->port_init = silabs_port_init;
     driver->port_deinit = silabs_port_deinit;
     driver->port_set_line_config = silabs_port_set_line_config;
+    driver->port_set_flow_control = silabs_port_set_flow_control;
+    driver->port_set_option = NULL;
     driver->start_reader = silabs_start_reader;
     driver->stop_reader = silabs_stop_reader;
     driver->write = silabs_write;
     driver->purge = silabs_purge;
+    driver->set_dtr_rts = silabs_set_dtr_rts;
+    driver->get_modem_status = silabs_get_modem_status;
     driver->read_data_postprocessor = NULL;
 }
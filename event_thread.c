@@ -0,0 +1,245 @@
+/*
+This file is part of libusbserial.
+
+libusbserial is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2 of the License.
+
+libusbserial is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libusbserial. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* This file contains the implementation of the library-owned libusb
+ * event thread. */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "event_thread.h"
+
+#include "internal.h"
+
+#include <assert.h>
+#include <errno.h>
+
+#ifndef _WIN32
+#include <sched.h>
+#endif
+
+static atomic_int event_thread_running;
+static atomic_int event_thread_stop_flag;
+/* Set on the event thread only, see usbserial_event_thread_is_current(). */
+static _Thread_local int event_thread_is_self = 0;
+/* Read by the writers, see usbserial_event_thread_get_context(). */
+static _Atomic(libusb_context*) event_thread_ctx = NULL;
+static atomic_uint event_thread_poll_timeout_millis = DEFAULT_EVENT_THREAD_POLL_TIMEOUT_MILLIS;
+
+#ifdef _WIN32
+static HANDLE event_thread_handle = NULL;
+#else
+static pthread_t event_thread_handle;
+#endif
+
+static void usbserial_event_thread_run(void)
+{
+    libusb_context* ctx = atomic_load(&event_thread_ctx);
+    unsigned int poll_timeout_millis = atomic_load(&event_thread_poll_timeout_millis);
+    struct timeval tv;
+
+    event_thread_is_self = 1;
+
+    while (!atomic_load(&event_thread_stop_flag))
+    {
+        tv.tv_sec = poll_timeout_millis / 1000;
+        tv.tv_usec = (poll_timeout_millis % 1000) * 1000;
+
+        /* Errors like LIBUSB_ERROR_INTERRUPTED are transient. */
+        libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI usbserial_event_thread_proc(LPVOID param)
+{
+    USBSERIAL_UNUSED_VAR(param);
+    usbserial_event_thread_run();
+    return 0;
+}
+#else
+static void* usbserial_event_thread_proc(void* param)
+{
+    USBSERIAL_UNUSED_VAR(param);
+    usbserial_event_thread_run();
+    return NULL;
+}
+#endif
+
+#ifdef _WIN32
+
+static int usbserial_event_thread_create(int cpu, int priority)
+{
+    event_thread_handle = CreateThread(
+                NULL,
+                0,
+                usbserial_event_thread_proc,
+                NULL,
+                CREATE_SUSPENDED,
+                NULL);
+    if (!event_thread_handle) return USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
+
+    if (((cpu >= 0)
+         && (0 == SetThreadAffinityMask(event_thread_handle, ((DWORD_PTR) 1) << cpu)))
+            || ((priority > 0)
+                && (!SetThreadPriority(event_thread_handle, THREAD_PRIORITY_TIME_CRITICAL))))
+    {
+        /* The thread never ran. */
+        TerminateThread(event_thread_handle, 0);
+        CloseHandle(event_thread_handle);
+        event_thread_handle = NULL;
+        return LIBUSB_ERROR_ACCESS;
+    }
+
+    ResumeThread(event_thread_handle);
+
+    return 0;
+}
+
+#else
+
+static int usbserial_event_thread_create(int cpu, int priority)
+{
+    pthread_attr_t attr;
+    int pthread_ret;
+    int ret = 0;
+
+    if (0 != pthread_attr_init(&attr)) return USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
+
+    if (cpu >= 0)
+    {
+#ifdef __linux__
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        CPU_SET(cpu, &cpu_set);
+        if (0 != pthread_attr_setaffinity_np(&attr, sizeof(cpu_set), &cpu_set))
+        {
+            ret = USBSERIAL_ERROR_INVALID_PARAMETER;
+            goto destroy_attr_and_return;
+        }
+#else
+        ret = USBSERIAL_ERROR_UNSUPPORTED_OPERATION;
+        goto destroy_attr_and_return;
+#endif
+    }
+
+    if (priority > 0)
+    {
+        struct sched_param param;
+        param.sched_priority = priority;
+
+        if ((0 != pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED))
+                || (0 != pthread_attr_setschedpolicy(&attr, SCHED_FIFO))
+                || (0 != pthread_attr_setschedparam(&attr, &param)))
+        {
+            ret = USBSERIAL_ERROR_INVALID_PARAMETER;
+            goto destroy_attr_and_return;
+        }
+    }
+
+    pthread_ret = pthread_create(&event_thread_handle, &attr, usbserial_event_thread_proc, NULL);
+    if (EPERM == pthread_ret) ret = LIBUSB_ERROR_ACCESS;
+    else if (EINVAL == pthread_ret) ret = USBSERIAL_ERROR_INVALID_PARAMETER;
+    else if (0 != pthread_ret) ret = USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
+
+destroy_attr_and_return:
+    pthread_attr_destroy(&attr);
+    return ret;
+}
+
+#endif
+
+int usbserial_event_thread_start(
+        libusb_context* ctx,
+        const struct usbserial_event_thread_config* config)
+{
+    int cpu = -1, priority = 0;
+    int ret;
+
+    if (atomic_load(&event_thread_running)) return USBSERIAL_ERROR_ILLEGAL_STATE;
+
+    atomic_store(&event_thread_poll_timeout_millis, DEFAULT_EVENT_THREAD_POLL_TIMEOUT_MILLIS);
+    if (config)
+    {
+        cpu = config->cpu;
+        priority = config->priority;
+        if (config->poll_timeout_millis > 0)
+        {
+            atomic_store(&event_thread_poll_timeout_millis, config->poll_timeout_millis);
+        }
+    }
+    if (priority < 0) return USBSERIAL_ERROR_INVALID_PARAMETER;
+#ifdef _WIN32
+    if (cpu >= (int) (8 * sizeof(DWORD_PTR))) return USBSERIAL_ERROR_INVALID_PARAMETER;
+#elif defined(__linux__)
+    if (cpu >= CPU_SETSIZE) return USBSERIAL_ERROR_INVALID_PARAMETER;
+#endif
+
+    atomic_store(&event_thread_ctx, ctx);
+    atomic_store(&event_thread_stop_flag, 0);
+
+    ret = usbserial_event_thread_create(cpu, priority);
+    if (0 != ret) return ret;
+
+    atomic_store(&event_thread_running, 1);
+
+    return 0;
+}
+
+int usbserial_event_thread_stop(void)
+{
+    if (!atomic_load(&event_thread_running)) return USBSERIAL_ERROR_ILLEGAL_STATE;
+    if (usbserial_event_thread_is_current()) return USBSERIAL_ERROR_ILLEGAL_STATE;
+
+    atomic_store(&event_thread_stop_flag, 1);
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+    libusb_interrupt_event_handler(atomic_load(&event_thread_ctx));
+#endif
+
+#ifdef _WIN32
+    WaitForSingleObject(event_thread_handle, INFINITE);
+    CloseHandle(event_thread_handle);
+    event_thread_handle = NULL;
+#else
+    pthread_join(event_thread_handle, NULL);
+#endif
+
+    atomic_store(&event_thread_running, 0);
+    atomic_store(&event_thread_ctx, NULL);
+
+    return 0;
+}
+
+int usbserial_event_thread_is_running(void)
+{
+    return atomic_load(&event_thread_running);
+}
+
+libusb_context* usbserial_event_thread_get_context(void)
+{
+    return atomic_load(&event_thread_running) ? atomic_load(&event_thread_ctx) : NULL;
+}
+
+unsigned int usbserial_event_thread_get_poll_timeout_millis(void)
+{
+    return atomic_load(&event_thread_poll_timeout_millis);
+}
+
+int usbserial_event_thread_is_current(void)
+{
+    return event_thread_is_self;
+}
@@ -0,0 +1,37 @@
+/*
+This file is part of libusbserial.
+
+libusbserial is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2 of the License.
+
+libusbserial is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libusbserial. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* This file contains the prototypes of the library-owned libusb event
+ * thread, see usbserial_event_thread_start(). */
+
+#ifndef LIBUSBSERIAL_EVENT_THREAD_H
+#define LIBUSBSERIAL_EVENT_THREAD_H
+
+#include "libusbserial.h"
+
+/* Returns a nonzero value, if called from the event thread. */
+int usbserial_event_thread_is_current(void);
+
+/* Returns a nonzero value, if the event thread was started. */
+int usbserial_event_thread_is_running(void);
+
+/* Returns the context of the event thread, NULL if it is not running. */
+libusb_context* usbserial_event_thread_get_context(void);
+
+/* Returns the poll timeout of the event thread in milliseconds. */
+unsigned int usbserial_event_thread_get_poll_timeout_millis(void);
+
+#endif // LIBUSBSERIAL_EVENT_THREAD_H
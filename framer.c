@@ -0,0 +1,470 @@
+/*
+This file is part of libusbserial.
+
+libusbserial is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2 of the License.
+
+libusbserial is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libusbserial. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* This file contains the implementation of the stream framer. */
+
+#include "framer.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SLIP_END 0xc0
+#define SLIP_ESC 0xdb
+#define SLIP_ESC_END 0xdc
+#define SLIP_ESC_ESC 0xdd
+
+#define COBS_DELIMITER 0x00
+
+int usbserial_framer_create(
+        struct usbserial_framer** out_framer,
+        const struct usbserial_frame_config* config,
+        usbserial_frame_cb_fn frame_cb,
+        void* cb_user_data)
+{
+    struct usbserial_framer* framer;
+    size_t max_frame_size = config->max_frame_size;
+    size_t capacity;
+
+    assert(out_framer);
+    assert(config);
+
+    *out_framer = NULL;
+
+    if (!frame_cb) return USBSERIAL_ERROR_INVALID_PARAMETER;
+    if ((USBSERIAL_FRAME_FIXED_LENGTH != config->mode) && (0 == max_frame_size))
+    {
+        return USBSERIAL_ERROR_INVALID_PARAMETER;
+    }
+
+    framer = (struct usbserial_framer*) calloc(1, sizeof(struct usbserial_framer));
+    if (!framer) return USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
+
+    switch (config->mode)
+    {
+    case USBSERIAL_FRAME_DELIMITER:
+        if ((0 == config->delimiter_length)
+                || (config->delimiter_length > USBSERIAL_FRAMER_MAX_DELIMITER_LENGTH))
+        {
+            goto invalid_parameter;
+        }
+        memcpy(framer->delimiter, config->delimiter, config->delimiter_length);
+        framer->delimiter_length = config->delimiter_length;
+        capacity = max_frame_size + framer->delimiter_length;
+        break;
+    case USBSERIAL_FRAME_FIXED_LENGTH:
+        if (0 == config->frame_length) goto invalid_parameter;
+        capacity = config->frame_length;
+        break;
+    case USBSERIAL_FRAME_LENGTH_PREFIX:
+        if ((1 != config->length_field_size)
+                && (2 != config->length_field_size)
+                && (4 != config->length_field_size))
+        {
+            goto invalid_parameter;
+        }
+        capacity = max_frame_size + config->length_field_size;
+        break;
+    case USBSERIAL_FRAME_COBS:
+        framer->delimiter[0] = COBS_DELIMITER;
+        framer->delimiter_length = 1;
+        /* One overhead byte per 254 bytes, plus the delimiter. */
+        capacity = max_frame_size + (max_frame_size / 254) + 2;
+        break;
+    case USBSERIAL_FRAME_SLIP:
+        framer->delimiter[0] = SLIP_END;
+        framer->delimiter_length = 1;
+        /* Each byte can be escaped. */
+        capacity = (2 * max_frame_size) + 1;
+        break;
+
+    default:
+        goto invalid_parameter;
+    }
+
+    framer->partial = (unsigned char*) malloc(capacity);
+    if (!framer->partial)
+    {
+        free(framer);
+        return USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
+    }
+    framer->partial_capacity = capacity;
+    framer->config = *config;
+    framer->frame_cb = frame_cb;
+    framer->cb_user_data = cb_user_data;
+
+    *out_framer = framer;
+
+    return 0;
+
+invalid_parameter:
+    free(framer);
+    return USBSERIAL_ERROR_INVALID_PARAMETER;
+}
+
+void usbserial_framer_destroy(struct usbserial_framer* framer)
+{
+    if (!framer) return;
+
+    free(framer->partial);
+    free(framer);
+}
+
+void usbserial_framer_reset(struct usbserial_framer* framer)
+{
+    assert(framer);
+
+    framer->partial_length = 0;
+    framer->discarding = 0;
+    framer->skip_count = 0;
+}
+
+static const unsigned char* usbserial_framer_find_delimiter(
+        const struct usbserial_framer* framer,
+        const unsigned char* data,
+        size_t length)
+{
+    const unsigned char* end = data + length;
+    size_t delimiter_length = framer->delimiter_length;
+
+    while ((size_t) (end - data) >= delimiter_length)
+    {
+        data = (const unsigned char*) memchr(
+                    data,
+                    framer->delimiter[0],
+                    (size_t) (end - data) - (delimiter_length - 1));
+        if (!data) return NULL;
+
+        if ((1 == delimiter_length)
+                || (0 == memcmp(data + 1, framer->delimiter + 1, delimiter_length - 1)))
+        {
+            return data;
+        }
+        ++data;
+    }
+
+    return NULL;
+}
+
+/* Returns a negative value for an invalid frame. */
+static long usbserial_framer_decode_cobs(unsigned char* data, size_t length)
+{
+    size_t read_pos = 0, write_pos = 0;
+
+    while (read_pos < length)
+    {
+        unsigned char code = data[read_pos++];
+        size_t block_length;
+
+        if (0 == code) return -1;
+
+        block_length = (size_t) code - 1;
+        if (block_length > length - read_pos) return -1;
+
+        memmove(data + write_pos, data + read_pos, block_length);
+        write_pos += block_length;
+        read_pos += block_length;
+
+        if ((0xff != code) && (read_pos < length)) data[write_pos++] = 0;
+    }
+
+    return (long) write_pos;
+}
+
+/* Returns a negative value for an invalid frame. */
+static long usbserial_framer_decode_slip(unsigned char* data, size_t length)
+{
+    unsigned char* esc = (unsigned char*) memchr(data, SLIP_ESC, length);
+    size_t read_pos, write_pos;
+
+    if (!esc) return (long) length;
+
+    read_pos = write_pos = (size_t) (esc - data);
+    while (read_pos < length)
+    {
+        unsigned char c = data[read_pos++];
+
+        if (SLIP_ESC == c)
+        {
+            if (read_pos >= length) return -1;
+            c = data[read_pos++];
+            if (SLIP_ESC_END == c) c = SLIP_END;
+            else if (SLIP_ESC_ESC == c) c = SLIP_ESC;
+            else return -1;
+        }
+        data[write_pos++] = c;
+    }
+
+    return (long) write_pos;
+}
+
+static void usbserial_framer_emit_delimited(
+        struct usbserial_framer* framer,
+        unsigned char* frame,
+        size_t length)
+{
+    long decoded_length = (long) length;
+
+    if (framer->discarding)
+    {
+        framer->discarding = 0;
+        return;
+    }
+
+    if (USBSERIAL_FRAME_COBS == framer->config.mode)
+    {
+        decoded_length = usbserial_framer_decode_cobs(frame, length);
+    }
+    else if (USBSERIAL_FRAME_SLIP == framer->config.mode)
+    {
+        decoded_length = usbserial_framer_decode_slip(frame, length);
+    }
+
+    /* Invalid, empty and too long frames are dropped. */
+    if ((decoded_length <= 0)
+            || ((size_t) decoded_length > framer->config.max_frame_size))
+    {
+        return;
+    }
+
+    framer->frame_cb(frame, (unsigned int) decoded_length, framer->cb_user_data);
+}
+
+static void usbserial_framer_process_delimited(
+        struct usbserial_framer* framer,
+        unsigned char* data,
+        size_t length)
+{
+    size_t delimiter_length = framer->delimiter_length;
+
+    while (length > 0)
+    {
+        const unsigned char* delimiter;
+        size_t old_length, copy_length, search_start;
+
+        if (0 == framer->partial_length)
+        {
+            /* Frames within data are passed without copying. */
+            delimiter = usbserial_framer_find_delimiter(framer, data, length);
+            if (delimiter)
+            {
+                size_t frame_length = (size_t) (delimiter - data);
+                usbserial_framer_emit_delimited(framer, data, frame_length);
+                data += frame_length + delimiter_length;
+                length -= frame_length + delimiter_length;
+                continue;
+            }
+        }
+
+        /* Search the appended bytes, including a delimiter which
+         * starts in the previously collected bytes. */
+        old_length = framer->partial_length;
+        copy_length = framer->partial_capacity - old_length;
+        if (copy_length > length) copy_length = length;
+        memcpy(framer->partial + old_length, data, copy_length);
+        framer->partial_length += copy_length;
+
+        search_start = (old_length >= delimiter_length - 1)
+                ? (old_length - (delimiter_length - 1))
+                : 0;
+        delimiter = usbserial_framer_find_delimiter(
+                    framer,
+                    framer->partial + search_start,
+                    framer->partial_length - search_start);
+        if (delimiter)
+        {
+            size_t frame_length = (size_t) (delimiter - framer->partial);
+            size_t consumed = frame_length + delimiter_length - old_length;
+            usbserial_framer_emit_delimited(framer, framer->partial, frame_length);
+            framer->partial_length = 0;
+            data += consumed;
+            length -= consumed;
+        }
+        else
+        {
+            data += copy_length;
+            length -= copy_length;
+            if (framer->partial_length == framer->partial_capacity)
+            {
+                /* Too long, skip until the next delimiter. Keep
+                 * the bytes which can start a delimiter. */
+                memmove(
+                        framer->partial,
+                        framer->partial + framer->partial_length - (delimiter_length - 1),
+                        delimiter_length - 1);
+                framer->partial_length = delimiter_length - 1;
+                framer->discarding = 1;
+            }
+        }
+    }
+}
+
+static void usbserial_framer_process_fixed_length(
+        struct usbserial_framer* framer,
+        unsigned char* data,
+        size_t length)
+{
+    size_t frame_length = framer->config.frame_length;
+
+    while (length > 0)
+    {
+        size_t copy_length;
+
+        if ((0 == framer->partial_length) && (length >= frame_length))
+        {
+            framer->frame_cb(data, (unsigned int) frame_length, framer->cb_user_data);
+            data += frame_length;
+            length -= frame_length;
+            continue;
+        }
+
+        copy_length = frame_length - framer->partial_length;
+        if (copy_length > length) copy_length = length;
+        memcpy(framer->partial + framer->partial_length, data, copy_length);
+        framer->partial_length += copy_length;
+        data += copy_length;
+        length -= copy_length;
+
+        if (framer->partial_length == frame_length)
+        {
+            framer->frame_cb(framer->partial, (unsigned int) frame_length, framer->cb_user_data);
+            framer->partial_length = 0;
+        }
+    }
+}
+
+static size_t usbserial_framer_parse_length(
+        const struct usbserial_framer* framer,
+        const unsigned char* field)
+{
+    size_t field_size = framer->config.length_field_size;
+    size_t value = 0;
+    size_t i;
+
+    for (i = 0; i < field_size; ++i)
+    {
+        size_t byte_idx = framer->config.length_big_endian ? i : (field_size - 1 - i);
+        value = (value << 8) | field[byte_idx];
+    }
+
+    return value;
+}
+
+static void usbserial_framer_process_length_prefix(
+        struct usbserial_framer* framer,
+        unsigned char* data,
+        size_t length)
+{
+    size_t field_size = framer->config.length_field_size;
+
+    while (length > 0)
+    {
+        size_t frame_length, copy_length;
+
+        if (framer->skip_count > 0)
+        {
+            copy_length = (framer->skip_count < length) ? framer->skip_count : length;
+            framer->skip_count -= copy_length;
+            data += copy_length;
+            length -= copy_length;
+            continue;
+        }
+
+        if ((0 == framer->partial_length) && (length >= field_size))
+        {
+            frame_length = usbserial_framer_parse_length(framer, data);
+            if (frame_length > framer->config.max_frame_size)
+            {
+                framer->skip_count = frame_length;
+                data += field_size;
+                length -= field_size;
+                continue;
+            }
+            if (length - field_size >= frame_length)
+            {
+                /* Frames within data are passed without copying. */
+                if (frame_length > 0)
+                {
+                    framer->frame_cb(data + field_size, (unsigned int) frame_length, framer->cb_user_data);
+                }
+                data += field_size + frame_length;
+                length -= field_size + frame_length;
+                continue;
+            }
+        }
+
+        if (framer->partial_length < field_size)
+        {
+            copy_length = field_size - framer->partial_length;
+            if (copy_length > length) copy_length = length;
+            memcpy(framer->partial + framer->partial_length, data, copy_length);
+            framer->partial_length += copy_length;
+            data += copy_length;
+            length -= copy_length;
+            if (framer->partial_length < field_size) break;
+
+            frame_length = usbserial_framer_parse_length(framer, framer->partial);
+            if (frame_length > framer->config.max_frame_size)
+            {
+                framer->skip_count = frame_length;
+                framer->partial_length = 0;
+                continue;
+            }
+        }
+        else
+        {
+            frame_length = usbserial_framer_parse_length(framer, framer->partial);
+        }
+
+        copy_length = field_size + frame_length - framer->partial_length;
+        if (copy_length > length) copy_length = length;
+        memcpy(framer->partial + framer->partial_length, data, copy_length);
+        framer->partial_length += copy_length;
+        data += copy_length;
+        length -= copy_length;
+
+        if (framer->partial_length == field_size + frame_length)
+        {
+            if (frame_length > 0)
+            {
+                framer->frame_cb(framer->partial + field_size, (unsigned int) frame_length, framer->cb_user_data);
+            }
+            framer->partial_length = 0;
+        }
+    }
+}
+
+void usbserial_framer_process(
+        struct usbserial_framer* framer,
+        unsigned char* data,
+        size_t length)
+{
+    assert(framer);
+
+    switch (framer->config.mode)
+    {
+    case USBSERIAL_FRAME_FIXED_LENGTH:
+        usbserial_framer_process_fixed_length(framer, data, length);
+        break;
+    case USBSERIAL_FRAME_LENGTH_PREFIX:
+        usbserial_framer_process_length_prefix(framer, data, length);
+        break;
+
+    default:
+        usbserial_framer_process_delimited(framer, data, length);
+        break;
+    }
+}
@@ -0,0 +1,66 @@
+/*
+This file is part of libusbserial.
+
+libusbserial is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2 of the License.
+
+libusbserial is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libusbserial. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* This file contains the prototypes of the stream framer, which
+ * splits received data into frames, see usbserial_port_set_framer(). */
+
+#ifndef LIBUSBSERIAL_FRAMER_H
+#define LIBUSBSERIAL_FRAMER_H
+
+#include "libusbserial.h"
+
+#include <stddef.h>
+
+#define USBSERIAL_FRAMER_MAX_DELIMITER_LENGTH 4
+
+struct usbserial_framer
+{
+    struct usbserial_frame_config config;
+    usbserial_frame_cb_fn frame_cb;
+    void* cb_user_data;
+
+    unsigned char delimiter[USBSERIAL_FRAMER_MAX_DELIMITER_LENGTH];
+    size_t delimiter_length;
+
+    /* Collects a frame which spans several read transfers. */
+    unsigned char* partial;
+    size_t partial_capacity;
+    size_t partial_length;
+
+    /* Set while the rest of a too long frame is skipped. */
+    int discarding;
+    size_t skip_count;
+};
+
+/* Returns zero on success, and an error code on failure. */
+int usbserial_framer_create(
+        struct usbserial_framer** out_framer,
+        const struct usbserial_frame_config* config,
+        usbserial_frame_cb_fn frame_cb,
+        void* cb_user_data);
+void usbserial_framer_destroy(struct usbserial_framer* framer);
+
+/* Discard a partially received frame. */
+void usbserial_framer_reset(struct usbserial_framer* framer);
+
+/* Pass complete frames in data to frame_cb and keep the rest.
+ * data can be modified, frames are decoded in place. */
+void usbserial_framer_process(
+        struct usbserial_framer* framer,
+        unsigned char* data,
+        size_t length);
+
+#endif // LIBUSBSERIAL_FRAMER_H
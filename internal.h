@@ -21,17 +21,64 @@ along with libusbserial. If not, see <http://www.gnu.org/licenses/>.
 
 #include "libusbserial.h"
 
+#include <stdatomic.h>
+
 #include "config.h"
+#include "framer.h"
+#include "ring_buffer.h"
 
 #define USBSERIAL_UNUSED_VAR(x) ((void)x)
 
 #ifdef _WIN32
 #   define WIN32_LEAN_AND_MEAN
-#   include <windows.>
+#   include <windows.h>
+typedef CRITICAL_SECTION usbserial_mutex_t;
+typedef CONDITION_VARIABLE usbserial_cond_t;
 #else
 #   include <pthread.h>
+typedef pthread_mutex_t usbserial_mutex_t;
+typedef pthread_cond_t usbserial_cond_t;
 #endif
 
+struct usbserial_port;
+
+/* A read buffer of a port's pool. A buffer is either attached to a
+ * read transfer, lent to the application or in the free list. */
+struct usbserial_buffer
+{
+    struct usbserial_port* port;
+    unsigned char* data;
+    unsigned int length;
+    uint64_t timestamp_micros;
+    atomic_int ref_count;
+    struct usbserial_buffer* next_free;
+};
+
+/* One of the bulk IN transfers kept in flight by the reader. */
+struct usbserial_read_transfer
+{
+    struct usbserial_port* port;
+    struct libusb_transfer* transfer;
+    struct usbserial_buffer* buffer;
+    int submitted;
+    int completed;
+    uint64_t timestamp_micros;
+};
+
+/* One of the bulk OUT transfers of the asynchronous writer. A transfer
+ * is either submitted or in the free list. */
+struct usbserial_write_transfer
+{
+    struct usbserial_port* port;
+    struct libusb_transfer* transfer;
+    usbserial_write_cb_fn write_cb;
+    void* user_data;
+    int submitted;
+    /* Owned buffer for coalesced data, see write_staging. */
+    unsigned char* buffer;
+    struct usbserial_write_transfer* next_free;
+};
+
 struct usbserial_port
 {
     struct usbserial_driver* driver;
@@ -39,18 +86,154 @@ struct usbserial_port
     libusb_device* usb_device;
     struct libusb_device_descriptor usb_device_descriptor;
     unsigned int port_idx;
+    /* The last line configuration set, baud is zero if none was set. */
+    struct usbserial_line_config line_config;
+    enum usbserial_flow_control flow_control;
     usbserial_read_cb_fn read_cb;
+    usbserial_read_cb_ex_fn read_cb_ex;
+    usbserial_buffer_read_cb_fn buffer_read_cb;
     usbserial_error_cb_fn read_error_cb;
     void* cb_user_data;
-    unsigned char read_buffer[READ_BUFFER_SIZE];
     void* driver_specific_data;
+    unsigned int read_queue_depth;
+    unsigned int read_buffer_size;
+    int read_timestamp_per_packet;
+    /* Negative for the adaptive timeout. */
+    int read_timeout_override;
+    unsigned int read_timeout_millis;
+    unsigned int read_idle_timeouts;
+    unsigned int read_max_packet_size;
+    struct usbserial_read_transfer* read_transfers;
+    unsigned int read_transfers_count;
+    unsigned int read_transfers_pending;
+    unsigned int read_next_transfer_idx;
+    unsigned int read_parked_first_idx;
+    unsigned int read_parked_count;
+    unsigned int read_callbacks_running;
+    int read_delivering;
+    /* Executor, see usbserial_port_set_read_executor(). Buffers are
+     * queued through next_free until a drain task processes them. */
+    usbserial_execute_fn read_execute;
+    void* read_executor_data;
+    struct usbserial_buffer* read_queue_head;
+    struct usbserial_buffer* read_queue_tail;
+    int read_drain_scheduled;
+    struct usbserial_buffer* read_buffer_pool;
+    unsigned char* read_buffer_pool_data;
+    unsigned int read_buffer_pool_count;
+    unsigned int read_lend_pool_size;
+    struct usbserial_buffer* read_free_buffers;
+    unsigned int read_buffers_lent;
+    unsigned int read_transfer_size;
+    /* Size of each pooled buffer, at least read_transfer_size. */
+    unsigned int read_buffer_capacity;
+    /* Transfers and coalescing buffer of the stopped reader, which
+     * are reused by its next start. */
+    struct usbserial_read_transfer* read_spare_transfers;
+    unsigned int read_spare_transfers_count;
+    unsigned char* read_coalesce_spare;
+    unsigned int read_coalesce_spare_capacity;
+    /* Alignment of pooled buffers, see usbserial_port_init_with_pools(). */
+    unsigned int buffer_alignment;
+    struct usbserial_framer* read_framer;
+    /* Modem status received by the reader, or -1 if unknown. */
+    atomic_int modem_status;
+    usbserial_modem_status_cb_fn modem_status_cb;
+    /* Set if modem_status_cb must be called with a changed status. */
+    int modem_status_changed;
+    /* Read coalescing, see usbserial_port_set_read_coalescing(). */
+    unsigned int read_coalesce_min_bytes;
+    unsigned int read_coalesce_max_delay_micros;
+    unsigned char* read_coalesce_buffer;
+    unsigned int read_coalesce_capacity;
+    unsigned int read_coalesce_count;
+    uint64_t read_coalesce_first_micros;
+    /* Back-pressure, see usbserial_port_set_backpressure(). The backlog
+     * is the data in the ring, or the data queued for the executor. */
+    enum usbserial_backpressure_policy read_backpressure;
+    unsigned int read_max_backlog;
+    unsigned int read_backlog_watermark;
+    usbserial_backlog_cb_fn read_backlog_cb;
+    int read_backlog_above_watermark;
+    unsigned int read_queue_bytes;
+    atomic_int read_paused;
+    struct usbserial_read_stats read_stats;
+    int read_stopping;
     int read_error_flag;
+    usbserial_mutex_t mutex;
+    usbserial_cond_t cancel_cond;
+    /* Buffered reading, see usbserial_read(). The ring is only
+     * accessed by the reader (producer) and by the thread calling
+     * usbserial_read() (consumer), read_ring_mutex is only used
+     * to wait for data. */
+    unsigned int read_ring_size;
+    struct usbserial_ring_buffer read_ring;
+    atomic_int read_ring_waiting;
+    atomic_int read_ring_status;
+    /* Readiness notification, see usbserial_port_get_read_event_fd().
+     * The write fd is the same as the read fd for an eventfd. */
+    atomic_int read_event_fd;
+    int read_event_write_fd;
+    atomic_int read_event_signaled;
+    usbserial_mutex_t read_ring_mutex;
+    usbserial_cond_t read_ring_cond;
+    /* Asynchronous writing, see usbserial_write_async(). The state is
+     * protected by mutex, write_cond is signalled when a transfer
+     * completed or data was staged. write_endpoint is set by the
+     * driver's port_init. */
+    unsigned char write_endpoint;
+    /* See usbserial_port_set_write_timeout(), zero for none. */
+    atomic_uint write_timeout_millis;
+    unsigned int write_queue_depth;
+    struct usbserial_write_transfer* write_transfers;
+    unsigned int write_transfers_count;
+    struct usbserial_write_transfer* write_free_transfers;
+    unsigned int write_transfers_pending;
+    unsigned int write_callbacks_running;
+    usbserial_cond_t write_cond;
+    /* Transmit coalescing, see usbserial_port_set_write_coalescing().
+     * Small writes are staged in the buffer of a reserved transfer,
+     * which is submitted once min_bytes are staged, or by the flusher
+     * thread after max_delay_micros. */
+    unsigned int write_coalesce_min_bytes;
+    unsigned int write_coalesce_max_delay_micros;
+    unsigned int write_coalesce_capacity;
+    struct usbserial_write_transfer* write_staging;
+    unsigned int write_staged_count;
+    uint64_t write_staged_first_micros;
+    /* The first error of a coalesced transfer, reported by the next
+     * usbserial_write() or usbserial_flush(). */
+    int write_staged_error;
+    /* Transmit pacing, see usbserial_port_set_write_pacing(). The
+     * pacer tracks when the device will have transmitted the data
+     * sent so far, the time per byte follows from line_config. */
+    unsigned int write_pacing_burst;
+    uint64_t write_pacing_byte_nanos;
+    uint64_t write_pacing_drained_nanos;
+    /* Transmit lanes, see usbserial_write_priority(). A synchronous
+     * write owns its lane until it returns, and the link while one of
+     * its pieces is sent, protected by mutex. */
+    int write_lane_owned[USBSERIAL_WRITE_PRIORITIES_COUNT];
+    int write_link_busy;
+    /* An XOFF was received and no XON since, see
+     * USBSERIAL_FLOW_CONTROL_XON_XOFF. */
+    int write_xoff;
+    /* Transfer of synchronous writes, which are serialized by the
+     * link, see usbserial_common_bulk_write(). */
+    struct libusb_transfer* write_sync_transfer;
+    int write_sync_completed;
+    /* Whether the device belongs to write_sync_ctx, the context of the
+     * event thread when it was last checked, protected by mutex. */
+    libusb_context* write_sync_ctx;
+    int write_sync_ctx_checked;
+    int write_sync_ctx_matches;
+    struct usbserial_write_lane_stats write_lane_stats[USBSERIAL_WRITE_PRIORITIES_COUNT];
+    int write_flusher_running;
+    int write_flusher_stopping;
 #ifdef _WIN32
-    CRITICAL_SECTION mutex;
-    HANDLE cancel_event;
+    HANDLE write_flusher_thread;
 #else
-    pthread_mutex_t mutex;
-    pthread_cond_t cancel_cond;
+    pthread_t write_flusher_thread;
 #endif
 };
 
@@ -21,14 +21,55 @@ along with libusbserial. If not, see <http://www.gnu.org/licenses/>.
 
 #include <libusb.h>
 
+#ifdef _WIN32
+#include <stddef.h>
+/* Same as the POSIX struct iovec. */
+struct iovec
+{
+    void* iov_base;
+    size_t iov_len;
+};
+#else
+#include <sys/uio.h>
+#endif
+
 struct usbserial_port;
+struct usbserial_buffer;
+struct usbserial_worker_pool;
 
 typedef void (*usbserial_read_cb_fn)(
         void* data, unsigned int bytes_count,
         void* user_data);
+typedef void (*usbserial_read_cb_ex_fn)(
+        void* data, unsigned int bytes_count,
+        uint64_t timestamp_micros,
+        void* user_data);
+typedef void (*usbserial_buffer_read_cb_fn)(
+        struct usbserial_buffer* buffer,
+        void* user_data);
+typedef void (*usbserial_frame_cb_fn)(
+        void* frame, unsigned int length,
+        void* user_data);
+typedef void (*usbserial_task_fn)(void* task_data);
+/* Run task(task_data) on some thread, returns zero if the task was
+ * accepted. */
+typedef int (*usbserial_execute_fn)(
+        usbserial_task_fn task,
+        void* task_data,
+        void* executor_data);
 typedef void (*usbserial_error_cb_fn)(
         enum libusb_transfer_status status,
         void* user_data);
+typedef void (*usbserial_write_cb_fn)(
+        enum libusb_transfer_status status,
+        unsigned int bytes_written,
+        void* user_data);
+typedef void (*usbserial_backlog_cb_fn)(
+        unsigned int backlog_bytes,
+        void* user_data);
+typedef void (*usbserial_modem_status_cb_fn)(
+        unsigned int modem_status,
+        void* user_data);
 
 enum usbserial_data_bits
 {
@@ -54,6 +95,39 @@ enum usbserial_parity
     USBSERIAL_PARITY_SPACE
 };
 
+enum usbserial_flow_control
+{
+    USBSERIAL_FLOW_CONTROL_NONE,
+    USBSERIAL_FLOW_CONTROL_RTS_CTS,
+    USBSERIAL_FLOW_CONTROL_DTR_DSR,
+    USBSERIAL_FLOW_CONTROL_XON_XOFF
+};
+
+/* Device specific options, see usbserial_port_set_option(). */
+enum usbserial_port_option
+{
+    /* FTDI: milliseconds (1 to 255) the device holds back a partially
+     * filled packet before sending it to the host (default: 16).
+     * A negative value selects the adaptive mode, which lowers the
+     * timer while the data arrives in small amounts, and raises it
+     * while data is streamed, to save USB bandwidth, and while the
+     * port is idle. The reader adapts the timer, while it is running. */
+    USBSERIAL_PORT_OPTION_LATENCY_TIMER,
+    /* FTDI: a character (0 to 255), which makes the device send the
+     * pending data as soon as it is received. A negative value disables
+     * the event character (default). */
+    USBSERIAL_PORT_OPTION_EVENT_CHAR
+};
+
+/* Modem status lines, see usbserial_get_modem_status(). */
+enum usbserial_modem_status
+{
+    USBSERIAL_MODEM_STATUS_CTS = 0x01,
+    USBSERIAL_MODEM_STATUS_DSR = 0x02,
+    USBSERIAL_MODEM_STATUS_RI = 0x04,
+    USBSERIAL_MODEM_STATUS_DCD = 0x08
+};
+
 struct usbserial_line_config
 {
     unsigned int baud;
@@ -62,6 +136,111 @@ struct usbserial_line_config
     enum usbserial_parity parity;
 };
 
+enum usbserial_frame_mode
+{
+    USBSERIAL_FRAME_NONE,
+    /* Frames end with a delimiter of 1 to 4 bytes. */
+    USBSERIAL_FRAME_DELIMITER,
+    /* Frames of frame_length bytes. */
+    USBSERIAL_FRAME_FIXED_LENGTH,
+    /* Frames start with their payload size in a length field of
+     * length_field_size (1, 2 or 4) bytes. */
+    USBSERIAL_FRAME_LENGTH_PREFIX,
+    /* COBS encoded frames, each followed by a zero byte. */
+    USBSERIAL_FRAME_COBS,
+    /* SLIP (RFC 1055) encoded frames. */
+    USBSERIAL_FRAME_SLIP
+};
+
+struct usbserial_frame_config
+{
+    enum usbserial_frame_mode mode;
+    unsigned char delimiter[4];
+    unsigned int delimiter_length;
+    unsigned int frame_length;
+    unsigned int length_field_size;
+    int length_big_endian;
+    /* Maximum (decoded) payload size, longer frames are discarded.
+     * Not used for USBSERIAL_FRAME_FIXED_LENGTH. */
+    unsigned int max_frame_size;
+};
+
+struct usbserial_pollfd
+{
+    int fd;
+    /* POLLIN and / or POLLOUT. */
+    short events;
+};
+
+enum usbserial_backpressure_policy
+{
+    /* Drop received data which does not fit (default). */
+    USBSERIAL_BACKPRESSURE_DROP_NEWEST = 0,
+    /* Drop the oldest unread data to make room. */
+    USBSERIAL_BACKPRESSURE_DROP_OLDEST,
+    /* Stop reading from the device until there is room again,
+     * the device's own buffer and flow control take over. */
+    USBSERIAL_BACKPRESSURE_BLOCK
+};
+
+struct usbserial_read_stats
+{
+    uint64_t bytes_received;
+    uint64_t bytes_dropped;
+    /* Count of transfers of which data was dropped. */
+    uint64_t drop_events;
+    /* Count of times reading was paused by USBSERIAL_BACKPRESSURE_BLOCK. */
+    uint64_t pauses;
+    unsigned int max_backlog;
+};
+
+/* Sizes of the pools preallocated by usbserial_port_init_with_pools(),
+ * zero selects the default. */
+struct usbserial_pool_config
+{
+    /* Count of bulk IN transfers, see usbserial_port_set_read_queue_depth(). */
+    unsigned int read_transfers;
+    /* Count of read buffers, more than read_transfers. */
+    unsigned int read_buffers;
+    /* See usbserial_port_set_read_buffer_size(). */
+    unsigned int read_buffer_size;
+    /* Count of bulk OUT transfers, see usbserial_port_set_write_queue_depth(). */
+    unsigned int write_transfers;
+    /* Alignment of buffers in bytes, a power of two (default: 64). */
+    unsigned int buffer_alignment;
+};
+
+enum usbserial_write_priority
+{
+    USBSERIAL_WRITE_PRIORITY_NORMAL = 0,
+    USBSERIAL_WRITE_PRIORITY_HIGH,
+    USBSERIAL_WRITE_PRIORITIES_COUNT
+};
+
+struct usbserial_write_lane_stats
+{
+    uint64_t writes;
+    uint64_t bytes_written;
+    /* Count of writes waiting or being sent, and its maximum. */
+    unsigned int queue_depth;
+    unsigned int max_queue_depth;
+    /* Time from the call of a write until it returned. */
+    uint64_t total_latency_micros;
+    uint64_t max_latency_micros;
+};
+
+struct usbserial_event_thread_config
+{
+    /* CPU the thread is pinned to, or -1 for no pinning. */
+    int cpu;
+    /* SCHED_FIFO priority, or 0 for the default scheduling policy.
+     * On Windows, any priority selects THREAD_PRIORITY_TIME_CRITICAL. */
+    int priority;
+    /* Maximum time blocked in libusb event handling, 0 for the
+     * default (100 ms). */
+    unsigned int poll_timeout_millis;
+};
+
 /* Initialize / deinitialize this library.
  * Results are undefined, if usbserial functions are called
  * before usbserial_init() is called and after usbserial_deinit()
@@ -71,6 +250,43 @@ struct usbserial_line_config
 int usbserial_init();
 int usbserial_deinit();
 
+/* Start / stop a thread which handles the libusb events of ctx (NULL
+ * for the default context), and thereby the reads and writes of all
+ * ports of that context. Otherwise, the application must handle
+ * libusb events itself. config can be NULL for the defaults.
+ * read_cb and the other callbacks of the ports are called in this
+ * thread. usbserial_stop_reader() and usbserial_event_thread_stop()
+ * must not be called from it.
+ * Pinning to a CPU is not supported on all platforms, and a real-time
+ * priority requires privileges, LIBUSB_ERROR_ACCESS is returned
+ * otherwise.
+ * These functions must not be called concurrently.
+ * Returns zero on success, and an error code on failure. */
+int usbserial_event_thread_start(
+        libusb_context* ctx,
+        const struct usbserial_event_thread_config* config);
+int usbserial_event_thread_stop(void);
+
+/* Export the file descriptors libusb needs to be polled on for ctx
+ * (NULL for the default context), to drive the library from an
+ * existing event loop instead of a thread. Up to max_count fds are
+ * stored in pollfds. If out_timeout_millis is not NULL, it is set to
+ * the time until libusb must handle events even if no fd is ready,
+ * or -1 if there is no such timeout. When an fd is ready or the
+ * timeout expired, usbserial_handle_events_nonblocking() must be
+ * called. The set of fds can change, see libusb_set_pollfd_notifiers().
+ * Not supported on Windows.
+ * Returns the total count of fds, which can be larger than max_count,
+ * and an error code on failure. */
+int usbserial_get_pollfds(
+        libusb_context* ctx,
+        struct usbserial_pollfd* pollfds,
+        unsigned int max_count,
+        int* out_timeout_millis);
+/* Handle pending libusb events of ctx without blocking.
+ * Returns zero on success, and an error code on failure. */
+int usbserial_handle_events_nonblocking(libusb_context* ctx);
+
 /* Returns a nonzero value, if a USB device is supported by one
  * of the libusbserial drivers. */
 int usbserial_is_device_supported(
@@ -108,6 +324,9 @@ unsigned int usbserial_get_ports_count(
  * return value.
  * read_cb must not be NULL, unless no read operations are performed
  * (usbserial_start_reader() is not called afterwards).
+ * read_cb is not called with the port's lock held, the reader
+ * resubmits the transfer with a spare buffer before calling it. Calls
+ * of read_cb are serialized and in the order the data was received.
  * read_error_cb can be NULL, then no read error notifications are sent. */
 int usbserial_port_init(
         struct usbserial_port** out_port,
@@ -116,6 +335,24 @@ int usbserial_port_init(
         usbserial_read_cb_fn read_cb,
         usbserial_error_cb_fn read_error_cb,
         void* cb_user_data);
+
+/* Same as usbserial_port_init(), but allocates the port's transfers
+ * and buffers of the sizes in pool_config up front. The reader reuses
+ * its transfers and buffers across usbserial_start_reader() /
+ * usbserial_stop_reader() cycles (also without preallocation), and
+ * synchronous writes use a preallocated transfer while the event
+ * thread runs, see usbserial_event_thread_start(). Pools which don't
+ * fit later settings are reallocated when they are used.
+ * Returns zero on success, and an error code on failure. */
+int usbserial_port_init_with_pools(
+        struct usbserial_port** out_port,
+        libusb_device_handle* usb_device_handle,
+        unsigned int port_idx,
+        usbserial_read_cb_fn read_cb,
+        usbserial_error_cb_fn read_error_cb,
+        void* cb_user_data,
+        const struct usbserial_pool_config* pool_config);
+
 /* Deinitialize / invalidate a serial port instance.
  * Returns zero on success, and an error code on failure.
  * Results are undefined, if usbserial_stop_reader() was
@@ -130,6 +367,241 @@ int usbserial_port_set_line_config(
         struct usbserial_port* port,
         const struct usbserial_line_config* line_config);
 
+/* Set the hardware flow control of a serial port instance (default:
+ * USBSERIAL_FLOW_CONTROL_NONE). The device stops transmitting while
+ * CTS / DSR is inactive, and deactivates RTS / DTR while its receive
+ * buffer is full. Supported by FTDI and CP210x devices, and RTS/CTS
+ * by PL2303 devices.
+ * USBSERIAL_FLOW_CONTROL_XON_XOFF is supported by all devices: the
+ * reader removes XON and XOFF characters from the received data, and
+ * writes wait from an XOFF until the next XON. Transfers which were
+ * submitted before the XOFF was received are not held back. FTDI
+ * devices stop transmitting on XOFF themselves as well. In this mode,
+ * an asynchronous write called on the libusb event thread fails with
+ * USBSERIAL_ERROR_ILLEGAL_STATE while writes are held back.
+ * Returns zero on success, and an error code on failure.
+ * Returns USBSERIAL_ERROR_UNSUPPORTED_OPERATION, if the device
+ * doesn't support the flow control. */
+int usbserial_port_set_flow_control(
+        struct usbserial_port* port,
+        enum usbserial_flow_control flow_control);
+
+/* Set a device specific option of a serial port instance.
+ * Returns zero on success, and an error code on failure.
+ * Returns USBSERIAL_ERROR_UNSUPPORTED_OPERATION, if the device
+ * doesn't support the option. */
+int usbserial_port_set_option(
+        struct usbserial_port* port,
+        enum usbserial_port_option option,
+        int value);
+
+/* Set the timeout of bulk IN transfers in milliseconds. A transfer
+ * completes with the data received so far when it times out.
+ * Zero disables the timeout. A negative value selects the adaptive
+ * timeout (default): it is derived from the baud rate of the line
+ * configuration and the transfer size, so a partially filled transfer
+ * is delivered once no more data arrived for about two USB packet
+ * times (at least 10 ms, at most 200 ms). While the line is idle, it
+ * is doubled after each transfer which timed out without data, up to
+ * one second, unless read coalescing is enabled.
+ * Can be called while the reader is running, the timeout is used for
+ * transfers submitted afterwards.
+ * Returns zero on success, and an error code on failure. */
+int usbserial_port_set_read_timeout(
+        struct usbserial_port* port,
+        int timeout_millis);
+
+/* Set the count of bulk IN transfers which are kept in flight
+ * while the reader is running (default: 4). Additional transfers
+ * keep the USB IN pipe busy while read_cb processes data.
+ * Data is always passed to read_cb in the order it was received.
+ * Must not be called while the reader is running.
+ * Returns zero on success, and an error code on failure. */
+int usbserial_port_set_read_queue_depth(
+        struct usbserial_port* port,
+        unsigned int depth);
+
+/* Set the size of each bulk IN transfer of the reader in bytes
+ * (default: 256). Large transfers reduce the count of read_cb calls
+ * for streaming data, a single USB packet minimizes latency.
+ * The size is rounded up to a multiple of the endpoint's maximum
+ * packet size when the reader is started.
+ * Must not be called while the reader is running.
+ * Returns zero on success, and an error code on failure. */
+int usbserial_port_set_read_buffer_size(
+        struct usbserial_port* port,
+        unsigned int size);
+
+/* Enable buffered reading with a ring buffer of (at least) size
+ * bytes, or disable it if size is zero (default). If enabled,
+ * received data is stored in the ring buffer instead of being
+ * passed to read_cb, and read_cb can be NULL. The data is fetched
+ * with usbserial_read(). Data which does not fit into the ring
+ * buffer is discarded, see usbserial_port_set_backpressure().
+ * Must not be called while the reader is running. Disabling or
+ * resizing the ring buffer discards its contents.
+ * Returns zero on success, and an error code on failure. */
+int usbserial_port_set_read_ring_size(
+        struct usbserial_port* port,
+        unsigned int size);
+
+/* Enable zero-copy reading, or disable it if buffer_read_cb is NULL
+ * (default). If enabled, received data is passed to buffer_read_cb
+ * instead of read_cb, and read_cb can be NULL. buffer_read_cb gets
+ * a reference to the read buffer itself, the buffer is owned by the
+ * application until it is released with usbserial_buffer_release(),
+ * which can happen on any thread and at any time, also in
+ * buffer_read_cb. Meanwhile, the reader continues with other buffers
+ * of the port's pool. pool_size is the count of buffers which can be
+ * held by the application at the same time, before the reader
+ * pauses. Not used if buffered reading is enabled, see
+ * usbserial_port_set_read_ring_size().
+ * buffer_read_cb is not called with the port's lock held.
+ * All buffers must be released before usbserial_port_deinit() is
+ * called.
+ * Must not be called while the reader is running.
+ * Returns zero on success, and an error code on failure. */
+int usbserial_port_set_buffer_read_cb(
+        struct usbserial_port* port,
+        usbserial_buffer_read_cb_fn buffer_read_cb,
+        unsigned int pool_size);
+
+/* Access the received data of a buffer passed to buffer_read_cb. */
+void* usbserial_buffer_get_data(struct usbserial_buffer* buffer);
+unsigned int usbserial_buffer_get_size(const struct usbserial_buffer* buffer);
+/* Returns the time when the USB transfer carrying the data
+ * completed, see usbserial_get_timestamp_micros(). */
+uint64_t usbserial_buffer_get_timestamp_micros(const struct usbserial_buffer* buffer);
+/* Acquire an additional reference to a buffer. Each reference must
+ * be released with usbserial_buffer_release(). */
+void usbserial_buffer_retain(struct usbserial_buffer* buffer);
+/* Release a reference to a buffer. The buffer is reused by the
+ * reader once the last reference is released. */
+void usbserial_buffer_release(struct usbserial_buffer* buffer);
+
+/* Enable read coalescing, or disable it if min_bytes is zero
+ * (default). If enabled, received data is collected and passed to
+ * read_cb in one piece as soon as at least min_bytes bytes are
+ * available, or max_delay_micros microseconds after the oldest
+ * collected byte was received. The read transfer timeout is
+ * shortened to max_delay_micros, so the delay is bounded also if no
+ * more data is received. Only used for read_cb, not for buffered or
+ * zero-copy reading. Data which is still collected when the reader
+ * is stopped is passed to read_cb by usbserial_stop_reader().
+ * Must not be called while the reader is running.
+ * Returns zero on success, and an error code on failure. */
+int usbserial_port_set_read_coalescing(
+        struct usbserial_port* port,
+        unsigned int min_bytes,
+        unsigned int max_delay_micros);
+
+/* Enable the stream framer, or disable it if config is NULL or
+ * config->mode is USBSERIAL_FRAME_NONE (default). If enabled,
+ * received data is split into frames, which are passed to frame_cb
+ * instead of read_cb, and read_cb can be NULL. frame_cb gets the
+ * decoded payload without delimiter, length field or encoding.
+ * Frames within a single read transfer are passed without copying,
+ * frames spanning several transfers are collected first. Empty
+ * frames are not passed to frame_cb. Not used for buffered or
+ * zero-copy reading.
+ * frame_cb is called like read_cb, the frame data is only valid
+ * during the call. A partially received frame is discarded when
+ * the reader is started.
+ * Must not be called while the reader is running.
+ * Returns zero on success, and an error code on failure. */
+int usbserial_port_set_framer(
+        struct usbserial_port* port,
+        const struct usbserial_frame_config* config,
+        usbserial_frame_cb_fn frame_cb);
+
+/* Set an extended read callback, which is used instead of read_cb
+ * unless it is NULL (default). read_cb_ex additionally gets the time
+ * when the USB transfer carrying the data completed, see
+ * usbserial_get_timestamp_micros(). For coalesced data, it is the
+ * time the oldest byte was received.
+ * Must not be called while the reader is running.
+ * Returns zero on success, and an error code on failure. */
+int usbserial_port_set_read_cb_ex(
+        struct usbserial_port* port,
+        usbserial_read_cb_ex_fn read_cb_ex);
+
+/* Enable or disable (default) timestamps per USB packet. If enabled,
+ * each bulk IN transfer is limited to a single packet of the
+ * endpoint's maximum packet size, so each chunk of data (and each
+ * FTDI status packet) gets its own completion timestamp. This
+ * increases the count of transfers and callbacks, consider
+ * increasing the read queue depth, see
+ * usbserial_port_set_read_queue_depth(). Overrides the size set by
+ * usbserial_port_set_read_buffer_size().
+ * Must not be called while the reader is running.
+ * Returns zero on success, and an error code on failure. */
+int usbserial_port_set_read_timestamp_per_packet(
+        struct usbserial_port* port,
+        int enable);
+
+/* Returns the current time of the monotonic clock used for read
+ * timestamps, in microseconds. */
+uint64_t usbserial_get_timestamp_micros(void);
+
+/* Set an executor which runs the read callbacks (read_cb, read_cb_ex,
+ * buffer_read_cb, frame_cb and buffered reading), or run them in the
+ * libusb event thread if execute is NULL (default). The reader then
+ * only queues received data, and a task per port passes it on in
+ * order, so the ports of a context are processed in parallel. If
+ * execute does not accept the task, it is run in the calling thread.
+ * usbserial_worker_pool_execute() with a pool as executor_data is a
+ * ready-made executor. usbserial_stop_reader() waits for the port's
+ * task, the executor must keep running tasks until it returned.
+ * Must not be called while the reader is running.
+ * Returns zero on success, and an error code on failure. */
+int usbserial_port_set_read_executor(
+        struct usbserial_port* port,
+        usbserial_execute_fn execute,
+        void* executor_data);
+
+/* Set what happens when the application does not keep up with the
+ * device. The backlog is the unread data of buffered reading (see
+ * usbserial_port_set_read_ring_size()), or the data queued for the
+ * executor (see usbserial_port_set_read_executor()). In buffered
+ * reading the ring size is the limit, otherwise max_backlog_bytes is,
+ * 0 for no limit. For the executor, USBSERIAL_BACKPRESSURE_BLOCK stops
+ * submitting transfers at the limit, the transfers in flight can
+ * still exceed it. Callbacks run in the reader without an executor
+ * always block the reader, as do lent buffers.
+ * If high_watermark_bytes is not 0, backlog_cb is called with the
+ * port's callback user data when the backlog reaches it, and again
+ * only after the backlog fell below it. It is called by the reader
+ * and must not block.
+ * Must not be called while the reader is running.
+ * Returns zero on success, and an error code on failure. */
+int usbserial_port_set_backpressure(
+        struct usbserial_port* port,
+        enum usbserial_backpressure_policy policy,
+        unsigned int max_backlog_bytes,
+        unsigned int high_watermark_bytes,
+        usbserial_backlog_cb_fn backlog_cb);
+
+/* Get the port's read statistics, and reset them if reset is nonzero.
+ * Returns zero on success, and an error code on failure. */
+int usbserial_port_get_read_stats(
+        struct usbserial_port* port,
+        struct usbserial_read_stats* stats,
+        int reset);
+
+/* Create / destroy a fixed pool of worker threads. Destroying the
+ * pool runs the queued tasks first and waits for the threads, the
+ * readers of ports using the pool must have been stopped.
+ * Returns zero on success, and an error code on failure. */
+int usbserial_worker_pool_create(
+        struct usbserial_worker_pool** out_pool,
+        unsigned int threads_count);
+int usbserial_worker_pool_destroy(struct usbserial_worker_pool* pool);
+/* A usbserial_execute_fn, executor_data is the pool. */
+int usbserial_worker_pool_execute(
+        usbserial_task_fn task,
+        void* task_data,
+        void* executor_data);
+
 /* Start reading from the port.
  * Returns zero on success, and an error code on failure. */
 int usbserial_start_reader(struct usbserial_port* port);
@@ -139,15 +611,204 @@ int usbserial_start_reader(struct usbserial_port* port);
  * It is guaranteed that read_cb is not called again after this
  * function has returned.
  * This function must not be called from the same thread in which
- * the libusb events are handled! */
+ * the libusb events are handled! It returns
+ * USBSERIAL_ERROR_ILLEGAL_STATE if called from the thread started by
+ * usbserial_event_thread_start(). */
 int usbserial_stop_reader(struct usbserial_port* port);
 
-/* Synchronously write data to a port.
+/* Read up to bytes_count buffered bytes, see
+ * usbserial_port_set_read_ring_size().
+ * Waits up to timeout_millis milliseconds until data is available,
+ * returns immediately if timeout_millis is zero and waits without
+ * a timeout if timeout_millis is negative.
+ * Returns the count of bytes read, which is zero if the timeout
+ * expired, and an error code on failure. After a read error or
+ * after usbserial_stop_reader() was called, the remaining data is
+ * returned first, then an error code.
+ * Only one thread at a time may read from a port. It does not
+ * contend with the reader for the port's lock. */
+int usbserial_read(
+        struct usbserial_port* port,
+        void* data,
+        unsigned int bytes_count,
+        int timeout_millis);
+/* Returns the count of buffered bytes which can be read without
+ * blocking, and an error code on failure. */
+int usbserial_bytes_available(struct usbserial_port* port);
+
+/* Get a file descriptor (an eventfd on Linux, a pipe elsewhere),
+ * which is readable while buffered data (see
+ * usbserial_port_set_read_ring_size()) or a read error is pending,
+ * to wait for a port in an epoll / poll loop. The fd must not be
+ * read or closed by the application, it becomes unreadable once
+ * usbserial_read() has returned all buffered data, or when the
+ * reader is started. Without a ring buffer, only read errors are
+ * signalled. The fd is closed by usbserial_port_deinit().
+ * Not supported on Windows.
+ * Returns the fd, and an error code on failure. */
+int usbserial_port_get_read_event_fd(struct usbserial_port* port);
+
+/* Synchronously write data to a port, with the port's write timeout,
+ * see usbserial_port_set_write_timeout(). Waits for the pending
+ * asynchronous writes first, see usbserial_write_async(). With
+ * transmit coalescing, small writes only copy data to the transmit
+ * buffer, see usbserial_port_set_write_coalescing().
  * Returns zero on success, and an error code on failure. */
 int usbserial_write(
         struct usbserial_port* port,
         const void* data,
         unsigned int bytes_count);
+
+/* Same as usbserial_write(), but returns LIBUSB_ERROR_TIMEOUT if the
+ * data was not sent within timeout_millis milliseconds (zero for no
+ * timeout). The count of bytes accepted by the device is stored in
+ * out_bytes_written (can be NULL), also on failure. */
+int usbserial_write_timeout(
+        struct usbserial_port* port,
+        const void* data,
+        unsigned int bytes_count,
+        unsigned int timeout_millis,
+        unsigned int* out_bytes_written);
+
+/* Same as usbserial_write_timeout(), in the transmit lane of priority.
+ * Writes are sent in pieces of at most 16 KiB, a write of a higher
+ * priority is sent before the next piece of lower priority writes.
+ * Writes of the same priority are sent in order. Like all synchronous
+ * writes, it waits for the pending asynchronous writes first.
+ * Returns zero on success, and an error code on failure. */
+int usbserial_write_priority(
+        struct usbserial_port* port,
+        const void* data,
+        unsigned int bytes_count,
+        enum usbserial_write_priority priority,
+        unsigned int timeout_millis,
+        unsigned int* out_bytes_written);
+
+/* Get the statistics of a transmit lane, see usbserial_write_priority(),
+ * and reset them (except the current queue depth) if reset is nonzero.
+ * usbserial_write() and usbserial_writev() use the normal priority lane.
+ * Returns zero on success, and an error code on failure. */
+int usbserial_port_get_write_lane_stats(
+        struct usbserial_port* port,
+        enum usbserial_write_priority priority,
+        struct usbserial_write_lane_stats* stats,
+        int reset);
+
+/* Set the timeout of usbserial_write(), usbserial_writev(),
+ * usbserial_flush() and of each asynchronous or coalesced transfer,
+ * in milliseconds, or zero for no timeout (default). It also bounds
+ * the waits of usbserial_write_async() for a free transfer and for an
+ * XON, see USBSERIAL_FLOW_CONTROL_XON_XOFF.
+ * Returns zero on success, and an error code on failure. */
+int usbserial_port_set_write_timeout(
+        struct usbserial_port* port,
+        unsigned int timeout_millis);
+
+/* Synchronously write the iov_count segments of iov to a port, as
+ * usbserial_write() does with their concatenation. Small segments
+ * are copied to a buffer and sent together, segments of 512 bytes or
+ * more are sent without copying.
+ * Returns zero on success, and an error code on failure. */
+int usbserial_writev(
+        struct usbserial_port* port,
+        const struct iovec* iov,
+        unsigned int iov_count);
+
+/* Enable transmit coalescing, or disable it if min_bytes is zero
+ * (default). If enabled, usbserial_write() copies data of less than
+ * min_bytes bytes to a transmit buffer, and returns. The buffer is
+ * sent as one transfer as soon as it holds at least min_bytes bytes
+ * (e.g. the endpoint's maximum packet size), max_delay_micros
+ * microseconds after its oldest byte was written (unless zero), or
+ * when usbserial_flush() is called. Larger writes and asynchronous
+ * writes send the buffer first. Errors of buffered data are returned
+ * by the next usbserial_write() or usbserial_flush(), buffered data
+ * is discarded by usbserial_port_deinit().
+ * Must not be called while writes are pending.
+ * Returns zero on success, and an error code on failure. */
+int usbserial_port_set_write_coalescing(
+        struct usbserial_port* port,
+        unsigned int min_bytes,
+        unsigned int max_delay_micros);
+
+/* Send the transmit buffer (see usbserial_port_set_write_coalescing()),
+ * and wait until all writes were sent.
+ * Returns zero on success, and an error code on failure. */
+int usbserial_flush(struct usbserial_port* port);
+
+/* Enable transmit pacing, or disable it if burst_bytes is zero
+ * (default). If enabled, data is sent to the device no faster than
+ * its UART transmits it with the line configuration set by
+ * usbserial_port_set_line_config(), with at most burst_bytes bytes
+ * (e.g. the device's transmit FIFO size) queued in the device, which
+ * bounds the latency of data written later. Synchronous writes are
+ * split into pieces of burst_bytes bytes, and wait before each one.
+ * Asynchronous writes wait before they are submitted, unless called
+ * from the thread handling libusb events, but they are not split: a
+ * larger write is sent as one transfer, and can overrun the device's
+ * FIFO. Asynchronous writes should not be larger than burst_bytes
+ * bytes therefore. Coalesced data (see
+ * usbserial_port_set_write_coalescing()) is sent without waiting,
+ * it only delays the writes after it. Pacing takes effect once a
+ * line configuration was set.
+ * Returns zero on success, and an error code on failure. */
+int usbserial_port_set_write_pacing(
+        struct usbserial_port* port,
+        unsigned int burst_bytes);
+
+/* Set the count of bulk OUT transfers which can be in flight at
+ * the same time (default: 4), see usbserial_write_async().
+ * Must not be called while asynchronous writes are pending.
+ * Returns zero on success, and an error code on failure. */
+int usbserial_port_set_write_queue_depth(
+        struct usbserial_port* port,
+        unsigned int depth);
+
+/* Asynchronously write data to a port. data is not copied, it must
+ * stay valid until write_cb (which can be NULL) is called with the
+ * transfer's status, by the thread handling libusb events. Writes
+ * are sent in the order they were submitted. If the write queue is
+ * full, or an XOFF was received, waits until a transfer completed or
+ * the XON, or returns LIBUSB_ERROR_TIMEOUT after the port's write
+ * timeout, so this must not be called from the thread handling libusb
+ * events then, write_cb can submit the next write though. usbserial_port_deinit() cancels the pending
+ * writes.
+ * Returns zero on success, and an error code on failure. */
+int usbserial_write_async(
+        struct usbserial_port* port,
+        const void* data,
+        unsigned int bytes_count,
+        usbserial_write_cb_fn write_cb,
+        void* user_data);
+
+/* Set the DTR and RTS output lines, active if dtr / rts is nonzero.
+ * Returns zero on success, and an error code on failure. */
+int usbserial_set_dtr_rts(
+        struct usbserial_port* port,
+        int dtr,
+        int rts);
+
+/* Get the modem status lines, a combination of the
+ * usbserial_modem_status flags, in *out_modem_status. FTDI devices
+ * report it in each packet, so it is returned from a cache without a
+ * USB request while the reader is running.
+ * Returns zero on success, and an error code on failure.
+ * Not supported by all drivers / devices, returns
+ * USBSERIAL_ERROR_UNSUPPORTED_OPERATION in this case. */
+int usbserial_get_modem_status(
+        struct usbserial_port* port,
+        unsigned int* out_modem_status);
+
+/* Set a callback, which is called with the new modem status and the
+ * port's callback user data when the reader receives a changed modem
+ * status (FTDI devices only), or NULL. It is called by the reader
+ * and must not block.
+ * Must not be called while the reader is running.
+ * Returns zero on success, and an error code on failure. */
+int usbserial_port_set_modem_status_cb(
+        struct usbserial_port* port,
+        usbserial_modem_status_cb_fn modem_status_cb);
+
 /* Purge the hardware read (rx) / (tx) buffer.
  * Returns zero on success, and an error code on failure.
  * Not supported by all drivers / devices, returns
@@ -0,0 +1,187 @@
+/*
+This file is part of libusbserial.
+
+libusbserial is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2 of the License.
+
+libusbserial is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libusbserial. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* This file contains the implementation of the ring buffer
+ * which backs usbserial_read(). */
+
+#include "ring_buffer.h"
+
+#include "libusbserial.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+int usbserial_ring_buffer_init(
+        struct usbserial_ring_buffer* ring,
+        size_t capacity)
+{
+    assert(ring);
+    assert(capacity > 0);
+
+    size_t rounded_capacity = 1;
+    while (rounded_capacity < capacity) rounded_capacity <<= 1;
+
+    ring->data = (unsigned char*) malloc(rounded_capacity);
+    if (!ring->data) return USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
+
+    ring->capacity = rounded_capacity;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+
+    return 0;
+}
+
+void usbserial_ring_buffer_deinit(struct usbserial_ring_buffer* ring)
+{
+    assert(ring);
+
+    free(ring->data);
+    ring->data = NULL;
+    ring->capacity = 0;
+}
+
+size_t usbserial_ring_buffer_write(
+        struct usbserial_ring_buffer* ring,
+        const void* data,
+        size_t bytes_count)
+{
+    assert(ring);
+    assert(data || (0 == bytes_count));
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t free_count = ring->capacity - (head - tail);
+    size_t offset = head & (ring->capacity - 1);
+    size_t first_count;
+
+    if (bytes_count > free_count) bytes_count = free_count;
+    if (0 == bytes_count) return 0;
+
+    first_count = ring->capacity - offset;
+    if (first_count > bytes_count) first_count = bytes_count;
+
+    memcpy(ring->data + offset, data, first_count);
+    memcpy(ring->data, ((const unsigned char*) data) + first_count, bytes_count - first_count);
+
+    atomic_store_explicit(&ring->head, head + bytes_count, memory_order_release);
+
+    return bytes_count;
+}
+
+size_t usbserial_ring_buffer_write_overwrite(
+        struct usbserial_ring_buffer* ring,
+        const void* data,
+        size_t bytes_count)
+{
+    assert(ring);
+    assert(data || (0 == bytes_count));
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t dropped_count = 0;
+    size_t offset, first_count;
+
+    if (bytes_count > ring->capacity)
+    {
+        dropped_count = bytes_count - ring->capacity;
+        data = ((const unsigned char*) data) + dropped_count;
+        bytes_count = ring->capacity;
+    }
+    if (0 == bytes_count) return dropped_count;
+
+    for (;;)
+    {
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        size_t free_count = ring->capacity - (head - tail);
+        size_t discard_count;
+
+        if (bytes_count <= free_count) break;
+
+        discard_count = bytes_count - free_count;
+        if (atomic_compare_exchange_strong_explicit(
+                    &ring->tail,
+                    &tail,
+                    tail + discard_count,
+                    memory_order_acq_rel,
+                    memory_order_acquire))
+        {
+            dropped_count += discard_count;
+            break;
+        }
+    }
+
+    offset = head & (ring->capacity - 1);
+    first_count = ring->capacity - offset;
+    if (first_count > bytes_count) first_count = bytes_count;
+
+    memcpy(ring->data + offset, data, first_count);
+    memcpy(ring->data, ((const unsigned char*) data) + first_count, bytes_count - first_count);
+
+    atomic_store_explicit(&ring->head, head + bytes_count, memory_order_release);
+
+    return dropped_count;
+}
+
+size_t usbserial_ring_buffer_read(
+        struct usbserial_ring_buffer* ring,
+        void* data,
+        size_t bytes_count)
+{
+    assert(ring);
+    assert(data || (0 == bytes_count));
+
+    for (;;)
+    {
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        size_t used_count = head - tail;
+        size_t offset = tail & (ring->capacity - 1);
+        size_t read_count = bytes_count;
+        size_t first_count;
+
+        if (read_count > used_count) read_count = used_count;
+        if (0 == read_count) return 0;
+
+        first_count = ring->capacity - offset;
+        if (first_count > read_count) first_count = read_count;
+
+        memcpy(data, ring->data + offset, first_count);
+        memcpy(((unsigned char*) data) + first_count, ring->data, read_count - first_count);
+
+        /* Fails if the producer discarded the data meanwhile, see
+         * usbserial_ring_buffer_write_overwrite(), the copy is
+         * repeated then. */
+        if (atomic_compare_exchange_strong_explicit(
+                    &ring->tail,
+                    &tail,
+                    tail + read_count,
+                    memory_order_acq_rel,
+                    memory_order_acquire))
+        {
+            return read_count;
+        }
+    }
+}
+
+size_t usbserial_ring_buffer_used(struct usbserial_ring_buffer* ring)
+{
+    assert(ring);
+
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    return head - tail;
+}
@@ -0,0 +1,66 @@
+/*
+This file is part of libusbserial.
+
+libusbserial is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2 of the License.
+
+libusbserial is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libusbserial. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* This file contains the prototypes of a lock-free single producer /
+ * single consumer byte ring buffer. */
+
+#ifndef LIBUSBSERIAL_RING_BUFFER_H
+#define LIBUSBSERIAL_RING_BUFFER_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+/* head and tail are free-running byte counters. Only the producer
+ * advances head, the consumer advances tail, and so does the producer
+ * when it discards the oldest data. */
+struct usbserial_ring_buffer
+{
+    unsigned char* data;
+    size_t capacity;
+    atomic_size_t head;
+    atomic_size_t tail;
+};
+
+/* Allocate the buffer. The capacity is rounded up to a power of two. */
+int usbserial_ring_buffer_init(
+        struct usbserial_ring_buffer* ring,
+        size_t capacity);
+void usbserial_ring_buffer_deinit(struct usbserial_ring_buffer* ring);
+
+/* Producer side. Returns the count of bytes which fit into the
+ * buffer and were copied. */
+size_t usbserial_ring_buffer_write(
+        struct usbserial_ring_buffer* ring,
+        const void* data,
+        size_t bytes_count);
+
+/* Producer side. Discards the oldest data to make room, and returns
+ * the count of bytes which were discarded. */
+size_t usbserial_ring_buffer_write_overwrite(
+        struct usbserial_ring_buffer* ring,
+        const void* data,
+        size_t bytes_count);
+
+/* Consumer side. Returns the count of bytes copied to data. */
+size_t usbserial_ring_buffer_read(
+        struct usbserial_ring_buffer* ring,
+        void* data,
+        size_t bytes_count);
+
+/* Can be called from both sides. */
+size_t usbserial_ring_buffer_used(struct usbserial_ring_buffer* ring);
+
+#endif // LIBUSBSERIAL_RING_BUFFER_H
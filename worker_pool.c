@@ -0,0 +1,269 @@
+/*
+This file is part of libusbserial.
+
+libusbserial is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2 of the License.
+
+libusbserial is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libusbserial. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* This file contains the implementation of the worker pool, a
+ * ready-made executor for usbserial_port_set_read_executor(). */
+
+#include "common.h"
+#include "internal.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+struct usbserial_worker_task
+{
+    usbserial_task_fn task;
+    void* task_data;
+    struct usbserial_worker_task* next;
+};
+
+struct usbserial_worker_pool
+{
+    usbserial_mutex_t mutex;
+    usbserial_cond_t cond;
+    struct usbserial_worker_task* head;
+    struct usbserial_worker_task* tail;
+    /* Recycled task entries. */
+    struct usbserial_worker_task* free_tasks;
+    int stopping;
+    unsigned int threads_count;
+#ifdef _WIN32
+    HANDLE* threads;
+#else
+    pthread_t* threads;
+#endif
+};
+
+static void usbserial_worker_pool_run(struct usbserial_worker_pool* pool)
+{
+    usbserial_common_mutex_lock(&pool->mutex);
+
+    for (;;)
+    {
+        struct usbserial_worker_task* entry = pool->head;
+        usbserial_task_fn task;
+        void* task_data;
+
+        if (!entry)
+        {
+            if (pool->stopping) break;
+            usbserial_common_cond_wait(&pool->cond, &pool->mutex);
+            continue;
+        }
+
+        pool->head = entry->next;
+        if (!pool->head) pool->tail = NULL;
+
+        task = entry->task;
+        task_data = entry->task_data;
+        entry->next = pool->free_tasks;
+        pool->free_tasks = entry;
+
+        usbserial_common_mutex_unlock(&pool->mutex);
+        task(task_data);
+        usbserial_common_mutex_lock(&pool->mutex);
+    }
+
+    usbserial_common_mutex_unlock(&pool->mutex);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI usbserial_worker_pool_thread_proc(LPVOID param)
+{
+    usbserial_worker_pool_run((struct usbserial_worker_pool*) param);
+    return 0;
+}
+#else
+static void* usbserial_worker_pool_thread_proc(void* param)
+{
+    usbserial_worker_pool_run((struct usbserial_worker_pool*) param);
+    return NULL;
+}
+#endif
+
+static void usbserial_worker_pool_stop(struct usbserial_worker_pool* pool)
+{
+    unsigned int i;
+
+    usbserial_common_mutex_lock(&pool->mutex);
+    pool->stopping = 1;
+    usbserial_common_cond_broadcast(&pool->cond);
+    usbserial_common_mutex_unlock(&pool->mutex);
+
+    for (i = 0; i < pool->threads_count; ++i)
+    {
+#ifdef _WIN32
+        WaitForSingleObject(pool->threads[i], INFINITE);
+        CloseHandle(pool->threads[i]);
+#else
+        pthread_join(pool->threads[i], NULL);
+#endif
+    }
+    pool->threads_count = 0;
+}
+
+static void usbserial_worker_pool_free(struct usbserial_worker_pool* pool)
+{
+    while (pool->free_tasks)
+    {
+        struct usbserial_worker_task* entry = pool->free_tasks;
+        pool->free_tasks = entry->next;
+        free(entry);
+    }
+
+#ifdef _WIN32
+    DeleteCriticalSection(&pool->mutex);
+#else
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->cond);
+#endif
+
+    free(pool->threads);
+    free(pool);
+}
+
+int usbserial_worker_pool_create(
+        struct usbserial_worker_pool** out_pool,
+        unsigned int threads_count)
+{
+    struct usbserial_worker_pool* pool;
+    int ret = 0;
+
+    if (!out_pool) return USBSERIAL_ERROR_INVALID_PARAMETER;
+    *out_pool = NULL;
+    if (0 == threads_count) return USBSERIAL_ERROR_INVALID_PARAMETER;
+
+    pool = (struct usbserial_worker_pool*) calloc(1, sizeof(struct usbserial_worker_pool));
+    if (!pool) return USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
+
+    pool->threads = calloc(threads_count, sizeof(*pool->threads));
+    if (!pool->threads)
+    {
+        free(pool);
+        return USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
+    }
+
+#ifdef _WIN32
+    InitializeCriticalSection(&pool->mutex);
+    InitializeConditionVariable(&pool->cond);
+#else
+    if (0 != pthread_mutex_init(&pool->mutex, NULL))
+    {
+        free(pool->threads);
+        free(pool);
+        return USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
+    }
+    if (0 != pthread_cond_init(&pool->cond, NULL))
+    {
+        pthread_mutex_destroy(&pool->mutex);
+        free(pool->threads);
+        free(pool);
+        return USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
+    }
+#endif
+
+    while (pool->threads_count < threads_count)
+    {
+#ifdef _WIN32
+        pool->threads[pool->threads_count] = CreateThread(
+                    NULL, 0, usbserial_worker_pool_thread_proc, pool, 0, NULL);
+        if (!pool->threads[pool->threads_count])
+        {
+            ret = USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
+            break;
+        }
+#else
+        if (0 != pthread_create(
+                    &pool->threads[pool->threads_count],
+                    NULL,
+                    usbserial_worker_pool_thread_proc,
+                    pool))
+        {
+            ret = USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
+            break;
+        }
+#endif
+        ++pool->threads_count;
+    }
+
+    if (0 != ret)
+    {
+        usbserial_worker_pool_stop(pool);
+        usbserial_worker_pool_free(pool);
+        return ret;
+    }
+
+    *out_pool = pool;
+
+    return 0;
+}
+
+int usbserial_worker_pool_destroy(struct usbserial_worker_pool* pool)
+{
+    if (!pool) return USBSERIAL_ERROR_INVALID_PARAMETER;
+
+    usbserial_worker_pool_stop(pool);
+    assert(!pool->head);
+    usbserial_worker_pool_free(pool);
+
+    return 0;
+}
+
+int usbserial_worker_pool_execute(
+        usbserial_task_fn task,
+        void* task_data,
+        void* executor_data)
+{
+    struct usbserial_worker_pool* pool = (struct usbserial_worker_pool*) executor_data;
+    struct usbserial_worker_task* entry;
+
+    if ((!pool) || (!task)) return USBSERIAL_ERROR_INVALID_PARAMETER;
+
+    usbserial_common_mutex_lock(&pool->mutex);
+
+    if (pool->stopping)
+    {
+        usbserial_common_mutex_unlock(&pool->mutex);
+        return USBSERIAL_ERROR_ILLEGAL_STATE;
+    }
+
+    entry = pool->free_tasks;
+    if (entry)
+    {
+        pool->free_tasks = entry->next;
+    }
+    else
+    {
+        entry = (struct usbserial_worker_task*) malloc(sizeof(struct usbserial_worker_task));
+        if (!entry)
+        {
+            usbserial_common_mutex_unlock(&pool->mutex);
+            return USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
+        }
+    }
+
+    entry->task = task;
+    entry->task_data = task_data;
+    entry->next = NULL;
+    if (pool->tail) pool->tail->next = entry;
+    else pool->head = entry;
+    pool->tail = entry;
+
+    usbserial_common_cond_signal(&pool->cond);
+    usbserial_common_mutex_unlock(&pool->mutex);
+
+    return 0;
+}
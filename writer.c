@@ -0,0 +1,976 @@
+/*
+This file is part of libusbserial.
+
+libusbserial is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2 of the License.
+
+libusbserial is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libusbserial. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* This file contains the implementation of the asynchronous writer. */
+
+#include "writer.h"
+
+#include "common.h"
+#include "driver.h"
+#include "event_thread.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void usbserial_writer_put_transfer(
+        struct usbserial_port* port,
+        struct usbserial_write_transfer* write_transfer)
+{
+    write_transfer->next_free = port->write_free_transfers;
+    port->write_free_transfers = write_transfer;
+}
+
+static void usbserial_writer_free_transfers(struct usbserial_port* port)
+{
+    unsigned int i;
+
+    assert(0 == port->write_transfers_pending);
+    assert(!port->write_staging);
+
+    if (port->write_transfers)
+    {
+        for (i = 0; i < port->write_transfers_count; ++i)
+        {
+            if (port->write_transfers[i].transfer)
+            {
+                libusb_free_transfer(port->write_transfers[i].transfer);
+            }
+            usbserial_common_aligned_free(port->write_transfers[i].buffer);
+        }
+        free(port->write_transfers);
+    }
+
+    port->write_transfers = NULL;
+    port->write_transfers_count = 0;
+    port->write_free_transfers = NULL;
+}
+
+/* Must be called with port->mutex locked. Transfers are allocated on
+ * first use, and reallocated after the queue depth was changed. */
+static int usbserial_writer_alloc_transfers(struct usbserial_port* port)
+{
+    unsigned int i;
+
+    if (port->write_transfers)
+    {
+        if ((port->write_transfers_count == port->write_queue_depth)
+                || (port->write_transfers_pending > 0)
+                || port->write_staging)
+        {
+            return 0;
+        }
+        usbserial_writer_free_transfers(port);
+    }
+
+    port->write_transfers = (struct usbserial_write_transfer*) calloc(
+                port->write_queue_depth,
+                sizeof(struct usbserial_write_transfer));
+    if (!port->write_transfers) return USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
+    port->write_transfers_count = port->write_queue_depth;
+
+    for (i = 0; i < port->write_transfers_count; ++i)
+    {
+        struct usbserial_write_transfer* write_transfer = &port->write_transfers[i];
+        write_transfer->port = port;
+        write_transfer->transfer = libusb_alloc_transfer(0);
+        if (!write_transfer->transfer)
+        {
+            usbserial_writer_free_transfers(port);
+            return USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
+        }
+        usbserial_writer_put_transfer(port, write_transfer);
+    }
+
+    return 0;
+}
+
+int usbserial_writer_prealloc(struct usbserial_port* port)
+{
+    assert(port);
+
+    int ret;
+
+    usbserial_common_mutex_lock(&port->mutex);
+    ret = usbserial_writer_alloc_transfers(port);
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    return ret;
+}
+
+/* Must be called with port->mutex locked, it is released while
+ * waiting for write_cond until deadline (zero for no deadline). */
+static int usbserial_writer_wait(struct usbserial_port* port, uint64_t deadline)
+{
+    unsigned int remaining_millis;
+    int ret;
+
+    ret = usbserial_common_get_remaining_millis(deadline, &remaining_millis);
+    if (0 != ret) return ret;
+
+    if (0 == remaining_millis)
+    {
+        usbserial_common_cond_wait(&port->write_cond, &port->mutex);
+    }
+    else
+    {
+        usbserial_common_cond_timedwait(&port->write_cond, &port->mutex, remaining_millis);
+    }
+
+    return 0;
+}
+
+/* Must be called with port->mutex locked, it is released while
+ * waiting for a free transfer until deadline (zero for no deadline). */
+static int usbserial_writer_take_transfer(
+        struct usbserial_port* port,
+        uint64_t deadline,
+        struct usbserial_write_transfer** out_write_transfer)
+{
+    int ret;
+
+    ret = usbserial_writer_alloc_transfers(port);
+    if (0 != ret) return ret;
+
+    while (!port->write_free_transfers)
+    {
+        /* The transfers can't complete while their events are not handled. */
+        if (usbserial_event_thread_is_current()) return USBSERIAL_ERROR_ILLEGAL_STATE;
+        ret = usbserial_writer_wait(port, deadline);
+        if (0 != ret) return ret;
+    }
+
+    *out_write_transfer = port->write_free_transfers;
+    port->write_free_transfers = (*out_write_transfer)->next_free;
+
+    return 0;
+}
+
+/* Must be called with port->mutex locked, it is released while
+ * waiting. Waits until deadline while an XOFF holds back writing. */
+static int usbserial_writer_wait_xon(struct usbserial_port* port, uint64_t deadline)
+{
+    int ret = 0;
+
+    while ((0 == ret) && port->write_xoff)
+    {
+        /* The XON is received on the event thread. */
+        if (usbserial_event_thread_is_current()) return USBSERIAL_ERROR_ILLEGAL_STATE;
+        ret = usbserial_writer_wait(port, deadline);
+    }
+
+    return ret;
+}
+
+static void usbserial_writer_transfer_callback(struct libusb_transfer* transfer)
+{
+    assert(transfer);
+
+    struct usbserial_write_transfer* write_transfer
+            = (struct usbserial_write_transfer*) transfer->user_data;
+    assert(write_transfer);
+    struct usbserial_port* port = write_transfer->port;
+    assert(port);
+
+    usbserial_write_cb_fn write_cb = write_transfer->write_cb;
+    void* user_data = write_transfer->user_data;
+    enum libusb_transfer_status status = transfer->status;
+    unsigned int bytes_written = (transfer->actual_length > 0)
+            ? (unsigned int) transfer->actual_length : 0;
+
+    /* The transfer is free again before write_cb is called,
+     * so write_cb can submit the next write. */
+    usbserial_common_mutex_lock(&port->mutex);
+    assert(write_transfer->submitted);
+    write_transfer->submitted = 0;
+    --port->write_transfers_pending;
+    ++port->write_callbacks_running;
+    usbserial_writer_put_transfer(port, write_transfer);
+    usbserial_common_cond_broadcast(&port->write_cond);
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    if (write_cb) write_cb(status, bytes_written, user_data);
+
+    usbserial_common_mutex_lock(&port->mutex);
+    --port->write_callbacks_running;
+    usbserial_common_cond_broadcast(&port->write_cond);
+    usbserial_common_mutex_unlock(&port->mutex);
+}
+
+/* Must be called with port->mutex locked. The transfer is returned
+ * to the free list, if it can't be submitted. */
+static int usbserial_writer_submit_transfer(
+        struct usbserial_port* port,
+        struct usbserial_write_transfer* write_transfer,
+        const void* data,
+        unsigned int bytes_count,
+        usbserial_write_cb_fn write_cb,
+        void* user_data)
+{
+    int ret;
+
+    write_transfer->write_cb = write_cb;
+    write_transfer->user_data = user_data;
+
+    libusb_fill_bulk_transfer(
+                write_transfer->transfer,
+                port->usb_device_handle,
+                port->write_endpoint,
+                (unsigned char*) data,
+                (int) bytes_count,
+                usbserial_writer_transfer_callback,
+                write_transfer,
+                atomic_load(&port->write_timeout_millis));
+
+    ret = libusb_submit_transfer(write_transfer->transfer);
+    if (0 == ret)
+    {
+        write_transfer->submitted = 1;
+        ++port->write_transfers_pending;
+    }
+    else
+    {
+        usbserial_writer_put_transfer(port, write_transfer);
+    }
+
+    return ret;
+}
+
+/* write_cb of coalesced transfers, user_data is the port. */
+static void usbserial_writer_staged_write_cb(
+        enum libusb_transfer_status status,
+        unsigned int bytes_written,
+        void* user_data)
+{
+    struct usbserial_port* port = (struct usbserial_port*) user_data;
+
+    USBSERIAL_UNUSED_VAR(bytes_written);
+
+    if (LIBUSB_TRANSFER_COMPLETED == status) return;
+
+    usbserial_common_mutex_lock(&port->mutex);
+    if (0 == port->write_staged_error)
+    {
+        port->write_staged_error = usbserial_common_get_transfer_error(status);
+    }
+    usbserial_common_mutex_unlock(&port->mutex);
+}
+
+/* Must be called with port->mutex locked, it is released while
+ * waiting. Waits until bytes_count bytes can be sent without more than
+ * write_pacing_burst bytes queued in the device, and accounts for them.
+ * Doesn't wait if wait is zero or on the event thread. The bytes are
+ * not split, a larger transfer exceeds the burst. */
+static int usbserial_writer_pace(
+        struct usbserial_port* port,
+        unsigned int bytes_count,
+        uint64_t deadline,
+        int wait)
+{
+    for (;;)
+    {
+        uint64_t byte_nanos = port->write_pacing_byte_nanos;
+        uint64_t now, burst_nanos, needed_nanos, wait_micros;
+
+        if ((0 == port->write_pacing_burst) || (0 == byte_nanos)) return 0;
+
+        now = usbserial_common_get_time_micros() * 1000;
+        if (port->write_pacing_drained_nanos < now)
+        {
+            port->write_pacing_drained_nanos = now;
+        }
+
+        burst_nanos = port->write_pacing_burst * byte_nanos;
+        needed_nanos = port->write_pacing_drained_nanos - now
+                + ((bytes_count < port->write_pacing_burst)
+                   ? bytes_count : port->write_pacing_burst) * byte_nanos;
+
+        if ((needed_nanos <= burst_nanos) || !wait || usbserial_event_thread_is_current())
+        {
+            port->write_pacing_drained_nanos += bytes_count * byte_nanos;
+            return 0;
+        }
+
+        wait_micros = (needed_nanos - burst_nanos + 999) / 1000;
+        if ((0 != deadline) && (now / 1000 + wait_micros > deadline))
+        {
+            return LIBUSB_ERROR_TIMEOUT;
+        }
+
+        usbserial_common_cond_timedwait(
+                    &port->write_cond,
+                    &port->mutex,
+                    (unsigned int) ((wait_micros + 999) / 1000));
+    }
+}
+
+/* Must be called with port->mutex locked. */
+static int usbserial_writer_submit_staged(struct usbserial_port* port)
+{
+    struct usbserial_write_transfer* write_transfer = port->write_staging;
+
+    if (!write_transfer) return 0;
+
+    port->write_staging = NULL;
+    usbserial_writer_pace(port, port->write_staged_count, 0, 0);
+    return usbserial_writer_submit_transfer(
+                port,
+                write_transfer,
+                write_transfer->buffer,
+                port->write_staged_count,
+                usbserial_writer_staged_write_cb,
+                port);
+}
+
+int usbserial_writer_submit(
+        struct usbserial_port* port,
+        const void* data,
+        unsigned int bytes_count,
+        usbserial_write_cb_fn write_cb,
+        void* user_data)
+{
+    assert(port);
+    assert((0 == bytes_count) || data);
+
+    struct usbserial_write_transfer* write_transfer;
+    uint64_t deadline;
+    int ret;
+
+    if (0 == bytes_count)
+    {
+        if (write_cb) write_cb(LIBUSB_TRANSFER_COMPLETED, 0, user_data);
+        return 0;
+    }
+
+    /* The waits for an XON and for a free transfer are bounded by the
+     * port's write timeout. */
+    deadline = usbserial_common_get_deadline_micros(atomic_load(&port->write_timeout_millis));
+
+    usbserial_common_mutex_lock(&port->mutex);
+
+    ret = usbserial_writer_wait_xon(port, deadline);
+    if (0 == ret) ret = usbserial_writer_submit_staged(port);
+    if (0 == ret) ret = usbserial_writer_take_transfer(port, deadline, &write_transfer);
+    if (0 == ret)
+    {
+        usbserial_writer_pace(port, bytes_count, 0, 1);
+        ret = usbserial_writer_submit_transfer(
+                    port,
+                    write_transfer,
+                    data,
+                    bytes_count,
+                    write_cb,
+                    user_data);
+    }
+
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    return ret;
+}
+
+int usbserial_writer_stage(
+        struct usbserial_port* port,
+        const void* data,
+        unsigned int bytes_count)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void*) data;
+    iov.iov_len = bytes_count;
+
+    return usbserial_writer_stagev(port, &iov, 1, bytes_count);
+}
+
+int usbserial_writer_stagev(
+        struct usbserial_port* port,
+        const struct iovec* iov,
+        unsigned int iov_count,
+        unsigned int bytes_count)
+{
+    assert(port);
+    assert((0 == iov_count) || iov);
+
+    unsigned int i;
+    int ret = 1;
+
+    usbserial_common_mutex_lock(&port->mutex);
+
+    /* While writing is held back, the data is written directly,
+     * which waits for the XON. */
+    if ((0 == port->write_coalesce_min_bytes)
+            || (bytes_count >= port->write_coalesce_min_bytes)
+            || port->write_xoff)
+    {
+        ret = 0;
+        goto unlock_and_return;
+    }
+
+    if (0 != port->write_staged_error)
+    {
+        ret = port->write_staged_error;
+        port->write_staged_error = 0;
+        goto unlock_and_return;
+    }
+
+    if (!port->write_staging)
+    {
+        struct usbserial_write_transfer* write_transfer;
+
+        ret = usbserial_writer_take_transfer(
+                    port,
+                    usbserial_common_get_deadline_micros(
+                        atomic_load(&port->write_timeout_millis)),
+                    &write_transfer);
+        if (0 != ret) goto unlock_and_return;
+        ret = 1;
+
+        if (port->write_staging || port->write_xoff)
+        {
+            /* Staged by another thread, or held back by an XOFF,
+             * meanwhile. */
+            usbserial_writer_put_transfer(port, write_transfer);
+        }
+        else
+        {
+            if (!write_transfer->buffer)
+            {
+                write_transfer->buffer = (unsigned char*) usbserial_common_aligned_alloc(
+                            port->write_coalesce_capacity,
+                            port->buffer_alignment);
+                if (!write_transfer->buffer)
+                {
+                    usbserial_writer_put_transfer(port, write_transfer);
+                    ret = USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
+                    goto unlock_and_return;
+                }
+            }
+            port->write_staging = write_transfer;
+            port->write_staged_count = 0;
+            port->write_staged_first_micros = usbserial_common_get_time_micros();
+            usbserial_common_cond_broadcast(&port->write_cond);
+        }
+    }
+
+    /* The lock may have been released while waiting for a transfer.
+     * Data which does not fit anymore, or is held back by an XOFF,
+     * is written directly, after the staged data. */
+    if (port->write_xoff
+            || (!port->write_staging)
+            || (port->write_staged_count + bytes_count > port->write_coalesce_capacity))
+    {
+        ret = 0;
+        goto unlock_and_return;
+    }
+
+    for (i = 0; i < iov_count; ++i)
+    {
+        memcpy(port->write_staging->buffer + port->write_staged_count,
+               iov[i].iov_base,
+               iov[i].iov_len);
+        port->write_staged_count += (unsigned int) iov[i].iov_len;
+    }
+
+    if (port->write_staged_count >= port->write_coalesce_min_bytes)
+    {
+        int submit_ret = usbserial_writer_submit_staged(port);
+        if (0 != submit_ret) ret = submit_ret;
+    }
+
+unlock_and_return:
+    usbserial_common_mutex_unlock(&port->mutex);
+    return ret;
+}
+
+/* Must be called with port->mutex locked. The link is free for the
+ * next piece of a write of priority, if no piece is being sent, no
+ * write of a higher priority is pending and no XOFF was received. */
+static int usbserial_writer_link_available(
+        struct usbserial_port* port,
+        enum usbserial_write_priority priority)
+{
+    int i;
+
+    if (port->write_link_busy || port->write_xoff) return 0;
+
+    for (i = priority + 1; i < USBSERIAL_WRITE_PRIORITIES_COUNT; ++i)
+    {
+        if (port->write_lane_owned[i]) return 0;
+    }
+
+    return 1;
+}
+
+/* Take the lane of priority until deadline. Owning the lane keeps
+ * writes of the same priority in order. */
+static int usbserial_writer_acquire_lane(
+        struct usbserial_port* port,
+        enum usbserial_write_priority priority,
+        uint64_t deadline)
+{
+    int ret = 0;
+
+    usbserial_common_mutex_lock(&port->mutex);
+    while ((0 == ret) && port->write_lane_owned[priority])
+    {
+        ret = usbserial_writer_wait(port, deadline);
+    }
+    if (0 == ret) port->write_lane_owned[priority] = 1;
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    return ret;
+}
+
+static void usbserial_writer_release_lane(
+        struct usbserial_port* port,
+        enum usbserial_write_priority priority)
+{
+    usbserial_common_mutex_lock(&port->mutex);
+    port->write_lane_owned[priority] = 0;
+    usbserial_common_cond_broadcast(&port->write_cond);
+    usbserial_common_mutex_unlock(&port->mutex);
+}
+
+/* Write with the driver's write hook, in the lane of priority, which
+ * the caller must own. The data is split into pieces of
+ * WRITE_LANE_CHUNK_SIZE, or at most write_pacing_burst bytes if pacing
+ * is enabled, so that writes of a higher priority are sent between
+ * them. */
+static int usbserial_writer_write_in_lane(
+        struct usbserial_port* port,
+        const unsigned char* data,
+        unsigned int bytes_count,
+        enum usbserial_write_priority priority,
+        uint64_t deadline,
+        unsigned int* out_bytes_written)
+{
+    unsigned int total_written = 0;
+    int ret = 0;
+
+    assert(port->write_lane_owned[priority]);
+
+    while ((0 == ret) && (total_written < bytes_count))
+    {
+        unsigned int length = bytes_count - total_written;
+        unsigned int bytes_written = 0;
+        unsigned int remaining_millis;
+
+        if (length > WRITE_LANE_CHUNK_SIZE) length = WRITE_LANE_CHUNK_SIZE;
+
+        usbserial_common_mutex_lock(&port->mutex);
+        while ((0 == ret) && !usbserial_writer_link_available(port, priority))
+        {
+            ret = port->write_xoff
+                    ? usbserial_writer_wait_xon(port, deadline)
+                    : usbserial_writer_wait(port, deadline);
+        }
+        if (0 != ret)
+        {
+            usbserial_common_mutex_unlock(&port->mutex);
+            break;
+        }
+        port->write_link_busy = 1;
+        if ((port->write_pacing_burst > 0) && (length > port->write_pacing_burst))
+        {
+            length = port->write_pacing_burst;
+        }
+        ret = usbserial_writer_pace(port, length, deadline, 1);
+        usbserial_common_mutex_unlock(&port->mutex);
+
+        if (0 == ret) ret = usbserial_common_get_remaining_millis(deadline, &remaining_millis);
+        if (0 == ret)
+        {
+            ret = port->driver->write(
+                        port,
+                        data + total_written,
+                        length,
+                        remaining_millis,
+                        &bytes_written);
+        }
+        total_written += bytes_written;
+
+        usbserial_common_mutex_lock(&port->mutex);
+        port->write_link_busy = 0;
+        usbserial_common_cond_broadcast(&port->write_cond);
+        usbserial_common_mutex_unlock(&port->mutex);
+    }
+
+    if (out_bytes_written) *out_bytes_written = total_written;
+
+    return ret;
+}
+
+/* Same as usbserial_writer_write_in_lane(), but takes the lane for
+ * the write. */
+static int usbserial_writer_write_paced(
+        struct usbserial_port* port,
+        const unsigned char* data,
+        unsigned int bytes_count,
+        enum usbserial_write_priority priority,
+        uint64_t deadline,
+        unsigned int* out_bytes_written)
+{
+    int ret;
+
+    if (out_bytes_written) *out_bytes_written = 0;
+
+    ret = usbserial_writer_acquire_lane(port, priority, deadline);
+    if (0 != ret) return ret;
+
+    ret = usbserial_writer_write_in_lane(
+                port,
+                data,
+                bytes_count,
+                priority,
+                deadline,
+                out_bytes_written);
+
+    usbserial_writer_release_lane(port, priority);
+
+    return ret;
+}
+
+int usbserial_writer_write(
+        struct usbserial_port* port,
+        const void* data,
+        unsigned int bytes_count,
+        enum usbserial_write_priority priority,
+        unsigned int timeout_millis,
+        unsigned int* out_bytes_written)
+{
+    assert(port);
+    assert((0 == bytes_count) || data);
+
+    return usbserial_writer_write_paced(
+                port,
+                (const unsigned char*) data,
+                bytes_count,
+                priority,
+                usbserial_common_get_deadline_micros(timeout_millis),
+                out_bytes_written);
+}
+
+void usbserial_writer_update_pacing(struct usbserial_port* port)
+{
+    assert(port);
+
+    const struct usbserial_line_config* line_config = &port->line_config;
+
+    if (0 == line_config->baud)
+    {
+        port->write_pacing_byte_nanos = 0;
+    }
+    else
+    {
+        port->write_pacing_byte_nanos
+                = (uint64_t) usbserial_common_get_bits_per_char(line_config)
+                    * 1000000000 / line_config->baud;
+    }
+}
+
+int usbserial_writer_writev(
+        struct usbserial_port* port,
+        const struct iovec* iov,
+        unsigned int iov_count,
+        unsigned int timeout_millis)
+{
+    assert(port);
+    assert((0 == iov_count) || iov);
+
+    unsigned char gather[WRITE_GATHER_BUFFER_SIZE];
+    unsigned int gathered = 0;
+    uint64_t deadline = usbserial_common_get_deadline_micros(timeout_millis);
+    unsigned int i;
+    int ret;
+
+    /* The lane is owned for the whole vector, so that no other write
+     * of the same priority is sent between its segments. */
+    ret = usbserial_writer_acquire_lane(port, USBSERIAL_WRITE_PRIORITY_NORMAL, deadline);
+    if (0 != ret) return ret;
+
+    for (i = 0; i <= iov_count; ++i)
+    {
+        const unsigned char* data = NULL;
+        unsigned int length = 0;
+
+        if (i < iov_count)
+        {
+            length = (unsigned int) iov[i].iov_len;
+            /* Segments of at least WRITE_GATHER_BUFFER_SIZE, a tuning
+             * constant, are sent without copying. */
+            if (length < sizeof(gather))
+            {
+                if (gathered + length <= sizeof(gather))
+                {
+                    memcpy(gather + gathered, iov[i].iov_base, length);
+                    gathered += length;
+                    continue;
+                }
+            }
+            else
+            {
+                /* Large enough to be sent as is. */
+                data = (const unsigned char*) iov[i].iov_base;
+            }
+        }
+
+        if (gathered > 0)
+        {
+            ret = usbserial_writer_write_in_lane(
+                        port,
+                        gather,
+                        gathered,
+                        USBSERIAL_WRITE_PRIORITY_NORMAL,
+                        deadline,
+                        NULL);
+            if (0 != ret) break;
+            gathered = 0;
+        }
+
+        if (data)
+        {
+            ret = usbserial_writer_write_in_lane(
+                        port,
+                        data,
+                        length,
+                        USBSERIAL_WRITE_PRIORITY_NORMAL,
+                        deadline,
+                        NULL);
+            if (0 != ret) break;
+        }
+        else if (i < iov_count)
+        {
+            /* Did not fit into the gather buffer, which is empty now. */
+            memcpy(gather, iov[i].iov_base, length);
+            gathered = length;
+        }
+    }
+
+    usbserial_writer_release_lane(port, USBSERIAL_WRITE_PRIORITY_NORMAL);
+
+    return ret;
+}
+
+int usbserial_writer_flush(
+        struct usbserial_port* port,
+        unsigned int timeout_millis)
+{
+    assert(port);
+
+    uint64_t deadline = usbserial_common_get_deadline_micros(timeout_millis);
+    int ret = 0;
+
+    usbserial_common_mutex_lock(&port->mutex);
+
+    if (port->write_staging) ret = usbserial_writer_wait_xon(port, deadline);
+    if (0 == ret) ret = usbserial_writer_submit_staged(port);
+    while ((0 == ret) && (port->write_transfers_pending > 0))
+    {
+        unsigned int remaining_millis;
+
+        if (usbserial_event_thread_is_current())
+        {
+            ret = USBSERIAL_ERROR_ILLEGAL_STATE;
+            break;
+        }
+
+        ret = usbserial_common_get_remaining_millis(deadline, &remaining_millis);
+        if (0 != ret) break;
+
+        if (0 == remaining_millis)
+        {
+            usbserial_common_cond_wait(&port->write_cond, &port->mutex);
+        }
+        else
+        {
+            usbserial_common_cond_timedwait(&port->write_cond, &port->mutex, remaining_millis);
+        }
+    }
+
+    if ((0 == ret) && (0 != port->write_staged_error))
+    {
+        ret = port->write_staged_error;
+        port->write_staged_error = 0;
+    }
+
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    return ret;
+}
+
+static void usbserial_writer_run_flusher(struct usbserial_port* port)
+{
+    usbserial_common_mutex_lock(&port->mutex);
+
+    while (!port->write_flusher_stopping)
+    {
+        uint64_t deadline, now;
+
+        if (!port->write_staging || port->write_xoff)
+        {
+            usbserial_common_cond_wait(&port->write_cond, &port->mutex);
+            continue;
+        }
+
+        deadline = port->write_staged_first_micros + port->write_coalesce_max_delay_micros;
+        now = usbserial_common_get_time_micros();
+        if (now >= deadline)
+        {
+            int ret = usbserial_writer_submit_staged(port);
+            if ((0 != ret) && (0 == port->write_staged_error))
+            {
+                port->write_staged_error = ret;
+            }
+        }
+        else
+        {
+            usbserial_common_cond_timedwait(
+                        &port->write_cond,
+                        &port->mutex,
+                        (unsigned int) ((deadline - now + 999) / 1000));
+        }
+    }
+
+    usbserial_common_mutex_unlock(&port->mutex);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI usbserial_writer_flusher_proc(LPVOID param)
+{
+    usbserial_writer_run_flusher((struct usbserial_port*) param);
+    return 0;
+}
+#else
+static void* usbserial_writer_flusher_proc(void* param)
+{
+    usbserial_writer_run_flusher((struct usbserial_port*) param);
+    return NULL;
+}
+#endif
+
+static int usbserial_writer_start_flusher(struct usbserial_port* port)
+{
+    if (port->write_flusher_running) return 0;
+
+    port->write_flusher_stopping = 0;
+#ifdef _WIN32
+    port->write_flusher_thread = CreateThread(
+                NULL, 0, usbserial_writer_flusher_proc, port, 0, NULL);
+    if (!port->write_flusher_thread) return USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
+#else
+    if (0 != pthread_create(
+                &port->write_flusher_thread,
+                NULL,
+                usbserial_writer_flusher_proc,
+                port))
+    {
+        return USBSERIAL_ERROR_RESOURCE_ALLOC_FAILED;
+    }
+#endif
+    port->write_flusher_running = 1;
+
+    return 0;
+}
+
+static void usbserial_writer_stop_flusher(struct usbserial_port* port)
+{
+    if (!port->write_flusher_running) return;
+
+    usbserial_common_mutex_lock(&port->mutex);
+    port->write_flusher_stopping = 1;
+    usbserial_common_cond_broadcast(&port->write_cond);
+    usbserial_common_mutex_unlock(&port->mutex);
+
+#ifdef _WIN32
+    WaitForSingleObject(port->write_flusher_thread, INFINITE);
+    CloseHandle(port->write_flusher_thread);
+#else
+    pthread_join(port->write_flusher_thread, NULL);
+#endif
+    port->write_flusher_running = 0;
+}
+
+int usbserial_writer_set_coalescing(
+        struct usbserial_port* port,
+        unsigned int min_bytes,
+        unsigned int max_delay_micros)
+{
+    assert(port);
+
+    unsigned int i;
+
+    usbserial_common_mutex_lock(&port->mutex);
+
+    if ((port->write_transfers_pending > 0) || port->write_staging)
+    {
+        usbserial_common_mutex_unlock(&port->mutex);
+        return USBSERIAL_ERROR_ILLEGAL_STATE;
+    }
+
+    /* Buffers of the previous capacity are reallocated on demand. */
+    for (i = 0; i < port->write_transfers_count; ++i)
+    {
+        usbserial_common_aligned_free(port->write_transfers[i].buffer);
+        port->write_transfers[i].buffer = NULL;
+    }
+
+    port->write_coalesce_min_bytes = min_bytes;
+    port->write_coalesce_max_delay_micros = max_delay_micros;
+    port->write_coalesce_capacity = 2 * min_bytes;
+
+    usbserial_common_mutex_unlock(&port->mutex);
+
+    if ((min_bytes > 0) && (max_delay_micros > 0))
+    {
+        return usbserial_writer_start_flusher(port);
+    }
+
+    usbserial_writer_stop_flusher(port);
+    return 0;
+}
+
+void usbserial_writer_stop(struct usbserial_port* port)
+{
+    assert(port);
+
+    unsigned int i;
+
+    usbserial_writer_stop_flusher(port);
+
+    usbserial_common_mutex_lock(&port->mutex);
+
+    if (port->write_staging)
+    {
+        usbserial_writer_put_transfer(port, port->write_staging);
+        port->write_staging = NULL;
+    }
+
+    for (i = 0; i < port->write_transfers_count; ++i)
+    {
+        if (port->write_transfers[i].submitted)
+        {
+            libusb_cancel_transfer(port->write_transfers[i].transfer);
+        }
+    }
+
+    while ((port->write_transfers_pending > 0) || (port->write_callbacks_running > 0))
+    {
+        usbserial_common_cond_wait(&port->write_cond, &port->mutex);
+    }
+
+    usbserial_writer_free_transfers(port);
+
+    usbserial_common_mutex_unlock(&port->mutex);
+}
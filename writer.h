@@ -0,0 +1,100 @@
+/*
+This file is part of libusbserial.
+
+libusbserial is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 2 of the License.
+
+libusbserial is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with libusbserial. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* This file contains the prototypes of the asynchronous writer, which
+ * keeps up to write_queue_depth bulk OUT transfers of a port in flight,
+ * see usbserial_write_async(), coalesces small writes, see
+ * usbserial_port_set_write_coalescing(), and paces the data to the
+ * line rate, see usbserial_port_set_write_pacing(). Only synchronous
+ * writes are split into pieces of the pacing burst, asynchronous and
+ * coalesced transfers are sent whole. Writing is held back while an
+ * XOFF is in effect, see usbserial_port_set_flow_control(). */
+
+#ifndef LIBUSBSERIAL_WRITER_H
+#define LIBUSBSERIAL_WRITER_H
+
+#include "internal.h"
+
+/* Allocate the write_queue_depth bulk OUT transfers ahead of the
+ * first asynchronous write. */
+int usbserial_writer_prealloc(struct usbserial_port* port);
+
+/* Submit a bulk OUT transfer of data to the port's write endpoint,
+ * after the staged data, and call write_cb when it completed. Waits
+ * for a free transfer, if write_queue_depth transfers are in flight. */
+int usbserial_writer_submit(
+        struct usbserial_port* port,
+        const void* data,
+        unsigned int bytes_count,
+        usbserial_write_cb_fn write_cb,
+        void* user_data);
+
+/* Copy data to the staging buffer, if coalescing is enabled and
+ * data is smaller than min_bytes. Returns 1 if the data was staged,
+ * zero if it must be written directly, and an error code on failure. */
+int usbserial_writer_stage(
+        struct usbserial_port* port,
+        const void* data,
+        unsigned int bytes_count);
+/* Same for the segments of iov, bytes_count is their total length. */
+int usbserial_writer_stagev(
+        struct usbserial_port* port,
+        const struct iovec* iov,
+        unsigned int iov_count,
+        unsigned int bytes_count);
+
+/* Write data with the driver's write hook in the transmit lane of
+ * priority, paced if transmit pacing is enabled, within timeout_millis
+ * milliseconds (zero for no timeout). */
+int usbserial_writer_write(
+        struct usbserial_port* port,
+        const void* data,
+        unsigned int bytes_count,
+        enum usbserial_write_priority priority,
+        unsigned int timeout_millis,
+        unsigned int* out_bytes_written);
+
+/* Recalculate the pacing byte time from the line configuration. Must
+ * be called with port->mutex locked. */
+void usbserial_writer_update_pacing(struct usbserial_port* port);
+
+/* Write the segments of iov with the driver's write hook, within
+ * timeout_millis milliseconds (zero for no timeout). Small segments
+ * are copied to a gather buffer and written together, segments which
+ * fill the buffer are written as they are. */
+int usbserial_writer_writev(
+        struct usbserial_port* port,
+        const struct iovec* iov,
+        unsigned int iov_count,
+        unsigned int timeout_millis);
+
+/* Submit the staged data, and wait until all submitted transfers
+ * completed, for at most timeout_millis milliseconds (zero for no
+ * timeout). Returns the first error of a coalesced transfer. */
+int usbserial_writer_flush(
+        struct usbserial_port* port,
+        unsigned int timeout_millis);
+
+int usbserial_writer_set_coalescing(
+        struct usbserial_port* port,
+        unsigned int min_bytes,
+        unsigned int max_delay_micros);
+
+/* Discard the staged data, cancel the submitted transfers, wait for
+ * their callbacks and free the transfers. */
+void usbserial_writer_stop(struct usbserial_port* port);
+
+#endif // LIBUSBSERIAL_WRITER_H